@@ -1,81 +1,42 @@
-#include <arpa/inet.h>
 #include <cerrno>
+#include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <arpa/inet.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/types.h>
-#include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <utility>
 #include <string>
 #include <iostream>
-#include <sstream>
-#include <iomanip>
-
-#define MSG_TYPE_QUERY    1      // 查询
-#define MSG_TYPE_DOWNLOAD 2      // 下载
-#define MSG_TYPE_UPLOAD   3      // 上传
-#define MSG_TYPE_ERROR    4      // 错误
-
-#define BUFFER_SIZE       1024   // buffer最大大小
-#define NAME_SIZE         50     // 文件名(路径)最大大小
-
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "netdisk_client.h"
+
+#define SYNC_DEFAULT_JOBS 4      // 同步时默认的并行传输数
+#define SYNC_PIPELINE     4      // 同步时每个连接上流水线的请求数
+#define SYNC_BUSY_RETRIES 5      // 同步时服务端繁忙的最大重试次数
+#define SYNC_BUSY_BACKOFF 100    // 同步时繁忙重试的最短间隔(毫秒, 每次重试翻倍)
+#define REPLAY_PREPARE_JOBS 8    // 回放前并行上传的合成文件数
+#define REPLAY_MAX_CONNECTIONS 64 // 回放时最多使用的连接数
+
+const char SERVER_IP[] = "120.46.38.26"; // 服务端地址(本机可以127.0.0.1)
 const char QUERY_PATH[] = ""; // 查询路径(网盘的相对路径)
 const char DOWNLOAD_PATH[] = "/home/draft/Clion/linux/client/download/"; // 下载路径(客户的绝对路径)
 const char UPLOAD_PATH[] = "/home/draft/Clion/linux/client/upload/"; // 上传路径(客户端的绝对路径)
 
-/**
- * 1: Hint
- * 2: Error
- * 3: Warn
- * 4: Info
- * 5: Debug
- */
-const int log_level = 5;
-
-// * \033[0m：重置所有颜色和样式设置。
-// * \033[1;32m：设置文本颜色为绿色。:Hint
-// * \033[1;31m：设置文本颜色为红色。:Error
-// * \033[1;33m：设置文本颜色为黄色。:Warn
-// * \033[1;34m：设置文本颜色为蓝色。:Log Debug
-// * \033[1;35m：设置文本颜色为紫色。:Info
-// * \033[1;36m：设置文本颜色为青色。
-// * \033[1;37m：设置文本颜色为白色。:input
-
-// 输出提示语
-void output_hint(const std::string &hint) { // green, always output
-    if (!(log_level >= 1)) return;
-    std::cout << "\033[1;32m" << "[Hint] " << hint << "\033[0m" << std::endl << std::flush;
-}
-
-// 输出错误
-void output_error(const std::string &hint) { // red
-    if (!(log_level >= 2)) return;
-    std::cout << "\033[1;31m" << hint << ": perror=" << std::flush;
-    perror("");
-    std::cout << "\033[0m" << std::flush << "\033[0m" << std::flush;
-}
-
-// 输出警告
-void output_warn(const std::string &hint) { // yellow
-    if (!(log_level >= 3)) return;
-    std::cout << "\033[1;33m" << "[Warn] " << hint << "\033[0m" << std::endl << std::flush;
-}
-
-// 输出运行信息
-void output_info(const std::string &hint) { // purple
-    if (!(log_level >= 4)) return;
-    std::cout << "\033[1;35m" << "[Info] " << hint << "\033[0m" << std::endl << std::flush;
-}
-
-// 输出调试信息
-void output_debug(const std::string &hint) { // blue
-    if (!(log_level >= 5)) return;
-    std::cout << "\033[1;34m" << "[Debug] " << hint << "\033[0m" << std::endl << std::flush;
-}
+// 上传时是否让服务端校验hash(校验时服务端不能使用零拷贝接收)
+const bool upload_checksum = false;
 
 // 输出提示，并要求输入(类似python的input)
 std::string input_with_hint(const std::string &hint = "") {
@@ -94,322 +55,748 @@ void net_disk_ui() {
     output_hint("\t3.upload");
     output_hint("\t4.refresh");
     output_hint("\t5.exit");
+    output_hint("\t6.query tree");
+    output_hint("\t7.search");
     output_hint("----Please select----");
 }
 
-// buffer转string(转为十六进制显示)
-std::string buffer_to_string(char *buffer, size_t n) {
-    std::string tmp;
-    for (int i = 0; i < n; ++i) {
-        tmp += "\\0x";
-        tmp += (std::stringstream() << std::hex << std::setw(2) << std::setfill('0') << int(uint8_t(buffer[i]))).str();
-    }
-    return tmp;
+// 事件循环线程(所有网络操作都在这里完成)
+void *thread_loop(void *arg) {
+    ((netdisk::EventLoop *) arg)->run();
+    return nullptr;
 }
 
-// 用于传递信息
-typedef struct msg {
-    int type;
-    int flag;
-    char buffer[BUFFER_SIZE];
-    char fname[NAME_SIZE];
-    int bytes;
+// 在事件循环线程中启动一个操作
+void run_in_loop(netdisk::Client &client, std::function<netdisk::Task<void>()> make_task) {
+    client.loop().post([&client, make_task] { client.loop().spawn(make_task()); });
+}
 
-    // 用于输出信息
-    std::string toString() {
-        std::stringstream ss;
-        auto buffer_copy = buffer_to_string(buffer, bytes);
-        if (type == -1) {
-            output_warn("get empty msg");
-        }
-        if (type == 0) {
-            output_warn("get empty msg");
-        }
-        ss << "msg{"
-           << ".type=" << type << ", "
-           << ".flag=" << flag << ", "
-           << ".buffer=" << R"(")" << buffer_copy << R"(")" << ", "
-           << ".fname=" << R"(")" << fname << R"(")" << ", "
-           << ".bytes=" << bytes << "}";
-        return ss.str();
-    }
-
-    // 清空结构体
-    void clear() {
-        type = -1;
-        flag = 0;
-        memset(buffer, 0, sizeof buffer);
-        memset(fname, 0, sizeof fname);
-        bytes = 0;
-    }
-} MSG;
-
-// 向socket中写入(发送)信息，同时输出log
-ssize_t read_net_with_log(int socket, MSG *m, size_t n, const std::string &hint) {
-    ssize_t res = read(socket, m, n);
-    output_debug("client <= " + m->toString() + " (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
-    return res;
-}
-
-// 从socket中读取(发送)信息，同时输出log
-ssize_t write_net_with_log(int socket, MSG *m, size_t n, const std::string &hint) {
-    ssize_t res = write(socket, m, n);
-    output_debug("client => " + m->toString() + " (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
-    return res;
-}
-
-// 从文件中读取信息，同时输出log
-ssize_t read_file_with_log(int fd, char *buffer, size_t n, const std::string &hint) {
-    ssize_t res = read(fd, buffer, n);
-    output_debug(
-            "file => " + buffer_to_string(buffer, res) + " (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
-    return res;
-}
-
-// 向文件中写入信息，同时输出log
-ssize_t write_file_with_log(int fd, char *buffer, size_t n, const std::string &hint) {
-    ssize_t res = write(fd, buffer, n);
-    output_debug(
-            "file <= " + buffer_to_string(buffer, res) + " (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
-    return res;
-}
-
-// 初始化client_socket
-int init_client_socket() {
-    int client_socket;
-    // 创建套接字
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket < 0) {
-        output_error("fail to create socket");
-        return client_socket;
-    }
-    // 设置ip地址和端口
-    struct sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr("120.46.38.26");// 本机可以127.0.0.1
-    server_addr.sin_port = htons(6667);
-    // 创建连接
-    if (connect(client_socket, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
-        output_error("fail to connect server!");
-        return client_socket;
-    }
-    output_info("finish connecting server!");
-    return client_socket;
-}
-
-// 接收专用线程
-void *thread_receive(void *arg) {
-    static int fd = -1;
-    int client_socket = *((int *) arg);
-    MSG receive_msg = {0};
-    ssize_t res;
-    std::string downloading_file;
-
-    for (receive_msg.clear(); true; receive_msg.clear()) {
-        res = read_net_with_log(client_socket, &receive_msg, sizeof(MSG), "switching");
-        if (res == 0) {
-            output_info("server finished connection");
-            break;
-        }
-        switch (receive_msg.type) {
-            case MSG_TYPE_QUERY:
-                output_info("query result: filename = " + std::string(receive_msg.fname));
-                break;
-            case MSG_TYPE_DOWNLOAD:
-                // 判断文件夹存在情况
-                if (mkdir(DOWNLOAD_PATH, S_IRWXU) < 0) {
-                    if (errno == EEXIST) {
-//                        output_info("dir exist");
-                    } else {
-                        output_error("fail to make dir");
-                        return nullptr;
-                    }
-                } else {
-                    output_warn("dir no exist, auto created");
-                }
-                // 打开文件
-                if (fd == -1) {
-                    downloading_file = std::string(DOWNLOAD_PATH) + receive_msg.fname;
-                    fd = open(downloading_file.c_str(), O_CREAT | O_WRONLY, 0666);
-                    if (fd < -1) {
-                        output_error("can't open file: " + downloading_file);
-                        fd = -1;
-                        downloading_file = "";
-                        break;
-                    }
-                    // 开始下载(第一次写入)
-                    output_info("downloading file: " + downloading_file);
-                }
-                // 防止多线程下载冲突
-                if (downloading_file != std::string(DOWNLOAD_PATH) + receive_msg.fname) {
-                    output_error("can't download file, wait for:" + downloading_file + "'s download");
-                    break;
-                }
-                // 写入文件
-                res = write_file_with_log(fd, receive_msg.buffer, receive_msg.bytes, "downloading, writing to file");
-                // 写入失败
-                if (res < 0) {
-                    output_error("fail to write file");
-                    close(fd);
-                    fd = -1;
-                    downloading_file = "";
-                }
-                // 下载完成(最后一次写入)
-                if (receive_msg.bytes < sizeof(receive_msg.buffer)) {
-                    output_info("downloaded file: " + downloading_file);
-                    close(fd);
-                    fd = -1;
-                    downloading_file = "";
-                }
-                break;
-            case MSG_TYPE_UPLOAD:
-                output_error("this branch is theoretically impossible to enter");
-                return nullptr;
-            case MSG_TYPE_ERROR:
-                output_error(receive_msg.fname);
-                break;
-            default:
-                output_error("unknown type" + std::to_string(receive_msg.type));
-                return nullptr;
+// 查询/递归查询的结果输出
+netdisk::Task<void> task_list(netdisk::Client &client, std::string path, int depth, std::string filter, bool tree) {
+    auto res = co_await client.list(path, depth, filter);
+    if (!res.ok()) {
+        output_error(res.message);
+        co_return;
+    }
+    for (auto &entry: res.value) {
+        if (tree) {
+            output_info("query tree result: filename = " + entry.path + ", size = " + std::to_string(entry.size) +
+                        ", mtime = " + std::to_string(entry.mtime));
+        } else {
+            output_info("query result: filename = " + entry.path);
         }
     }
-    return nullptr;
+    if (tree) output_info("query tree finished");
 }
 
 // 查询函数
-void func_query(int client_socket, MSG &send_msg) {
-    ssize_t res;
+void func_query(netdisk::Client &client) {
     std::string input;
 
-    send_msg.type = MSG_TYPE_QUERY;
     input = input_with_hint("please input the dir_path(relative path) to query(\"./\"=root)");
     if (*--input.end() != '/') {
         output_error("dir_path should be end with '/': " + input);
         return;
     }
     if (input == "./") input = "";
-    memcpy(send_msg.fname, (QUERY_PATH + input).c_str(), input.length());
     output_info("query dir_path: " + input);
-    res = write_net_with_log(client_socket, &send_msg, sizeof(MSG), "ask for file name");
-    if (res < 0) {
-        output_error("fail to send msg");
+    std::string path = QUERY_PATH + input;
+    run_in_loop(client, [&client, path] { return task_list(client, path, 1, "", false); });
+}
+
+// 递归查询函数
+void func_query_tree(netdisk::Client &client) {
+    std::string input, filter;
+
+    input = input_with_hint("please input the dir_path(relative path) to query(\"./\"=root)");
+    if (*--input.end() != '/') {
+        output_error("dir_path should be end with '/': " + input);
+        return;
+    }
+    if (input == "./") input = "";
+    std::string path = QUERY_PATH + input;
+    int depth = atoi(input_with_hint("please input the max depth(0=unlimited)").c_str());
+    filter = input_with_hint("please input the filename filter(\"*\"=all)");
+    if (filter == "*") filter = "";
+    output_info("query tree dir_path: " + path);
+    run_in_loop(client, [&client, path, depth, filter] { return task_list(client, path, depth, filter, true); });
+}
+
+// 搜索结果输出
+netdisk::Task<void> task_search(netdisk::Client &client, int mode, std::string pattern, uint64_t since) {
+    auto res = co_await client.search(mode, pattern, since);
+    if (!res.ok()) {
+        output_error(res.message);
+        if (res.error == ESTALE) {
+            output_info("generation " + std::to_string(since) + " is too old, search changed from 0 instead (generation = " +
+                        std::to_string(res.value.generation) + ")");
+        }
+        co_return;
+    }
+    for (auto &entry: res.value.entries) {
+        output_info("search result: filename = " + entry.path + ", size = " + std::to_string(entry.size) +
+                    ", mtime = " + std::to_string(entry.mtime) +
+                    ", generation = " + std::to_string(entry.generation) + (entry.deleted ? ", deleted" : ""));
+    }
+    output_info("search finished, generation = " + std::to_string(res.value.generation));
+}
+
+// 搜索函数
+void func_search(netdisk::Client &client) {
+    std::string input, pattern;
+    uint64_t since = 0;
+
+    input = input_with_hint("please input the search mode(0=prefix, 1=glob, 2=substring, 3=changed since)");
+    int mode = atoi(input.c_str());
+    if (mode == SEARCH_CHANGED) {
+        since = strtoull(input_with_hint("please input the generation").c_str(), nullptr, 10);
+    } else {
+        pattern = input_with_hint("please input the pattern(relative path)");
     }
+    output_info("search index: " + pattern);
+    run_in_loop(client, [&client, mode, pattern, since] { return task_search(client, mode, pattern, since); });
+}
 
+// 下载结果输出
+netdisk::Task<void> task_download(netdisk::Client &client, std::string remote_path, std::string local_path) {
+    output_info("downloading file: " + local_path);
+    auto res = co_await client.download(remote_path, local_path);
+    if (!res.ok()) {
+        output_error(res.message);
+        co_return;
+    }
+    output_info("downloaded file: " + local_path);
 }
 
 // 下载函数
-void func_download(int client_socket, MSG &send_msg) {
-    ssize_t res;
+void func_download(netdisk::Client &client) {
     std::string input;
 
-    send_msg.type = MSG_TYPE_DOWNLOAD;
     input = input_with_hint("please input the file_path(relative path) to download");
-    memcpy(send_msg.fname, input.c_str(), input.length());
     output_info("downloading file_path: " + input);
-    res = write_net_with_log(client_socket, &send_msg, sizeof(MSG), "ask for download");
+    std::string remote_path = input, local_path = DOWNLOAD_PATH + input;
+    run_in_loop(client, [&client, remote_path, local_path] {
+        return task_download(client, remote_path, local_path);
+    });
+}
+
+// 上传结果输出
+netdisk::Task<void> task_upload(netdisk::Client &client, std::string local_path, std::string remote_path) {
+    output_info("uploading file: " + local_path);
+    auto res = co_await client.upload(local_path, remote_path, upload_checksum);
+    if (!res.ok()) {
+        output_error(res.message);
+        co_return;
+    }
+    output_info("uploaded file: " + remote_path);
+}
+
+// 上传函数
+void func_upload(netdisk::Client &client) {
+    std::string input, upload_to_path, upload_from_path;
+
+    // 服务端目标路径
+    input = input_with_hint("please input the file_path(relative path) where upload to");
+    upload_to_path = QUERY_PATH + input;
+    output_info("upload to file_path: " + upload_to_path);
+
+    // 客户端文件路径
+    input = input_with_hint("please input the file_path(relative path) where upload from");
+    upload_from_path = UPLOAD_PATH + input;
+    output_info("upload from file_path: " + upload_from_path);
+
+    // 在事件循环中上传，不阻塞输入
+    run_in_loop(client, [&client, upload_from_path, upload_to_path] {
+        return task_upload(client, upload_from_path, upload_to_path);
+    });
+}
+
+// 同步中的一个远程文件
+struct sync_file {
+    std::string rel_path; // 相对于同步目录的路径
+    int64_t size;         // 服务端的大小
+    int64_t mtime;        // 服务端的修改时间
+};
+
+// 同步任务
+struct sync_job {
+    std::string remote_dir;           // 服务端目录(相对路径, 以'/'结尾, 根目录为"")
+    std::string local_dir;            // 本地目录(以'/'结尾)
+    bool use_hash = false;            // 大小相同时是否比较hash
+    std::vector<sync_file> files;     // 当前阶段要处理的文件
+    std::vector<sync_file> transfers; // 需要下载的文件
+    size_t next = 0;                  // 下一个要处理的文件下标
+    int failed = 0;                   // 失败的文件数
+};
+
+// 逐级创建目录(类似mkdir -p)
+int mkdir_recursive(const std::string &path) {
+    for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        if (mkdir(path.substr(0, pos).c_str(), S_IRWXU) < 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 服务端繁忙时等待后重试: 间隔取服务端建议和本地退避的较大值, 返回false表示不再重试
+// 再加上最多一半的随机抖动, 同时被拒绝的请求不会又同时重试
+netdisk::Task<bool> sync_busy_wait(netdisk::Client &client, const netdisk::Status &status, int &retries) {
+    static std::minstd_rand random(std::random_device{}());
+    if (status.error != EBUSY || retries >= SYNC_BUSY_RETRIES) co_return false;
+    int delay = std::max(status.retry_after, SYNC_BUSY_BACKOFF << retries++);
+    delay += (int) (random() % (delay / 2 + 1));
+    output_warn("server busy, retry after " + std::to_string(delay) + "ms");
+    co_await client.loop().sleep_for(std::chrono::milliseconds(delay));
+    co_return true;
+}
+
+// 比较hash, 不同则加入下载列表, 相同则同步修改时间
+netdisk::Task<bool> sync_compare_hash(netdisk::Client &client, sync_job &job, const sync_file &file) {
+    std::string local_path = job.local_dir + file.rel_path;
+    uint64_t local_hash;
+    int fd = open(local_path.c_str(), O_RDONLY);
+    // 读文件计算hash会阻塞, 交给工作线程(多个文件并行计算, 事件循环继续收发)
+    int res = -1;
+    if (fd >= 0) {
+        auto hashing = client.loop().offload([fd, &res, &local_hash] { res = hash_file(fd, local_hash); });
+        co_await hashing;
+    }
     if (res < 0) {
-        output_error("fail to send msg");
+        output_error("fail to hash file: " + local_path);
+        if (fd >= 0) close(fd);
+        co_return false;
+    }
+    auto remote_hash = co_await client.hash(job.remote_dir + file.rel_path);
+    for (int retries = 0; co_await sync_busy_wait(client, remote_hash, retries);) {
+        remote_hash = co_await client.hash(job.remote_dir + file.rel_path);
+    }
+    if (!remote_hash.ok()) {
+        output_error("fail to get hash: " + remote_hash.message);
+        close(fd);
+        co_return false;
+    }
+    if (local_hash == remote_hash.value) {
+        struct timespec times[2] = {{0, UTIME_OMIT}, {file.mtime, 0}};
+        futimens(fd, times);
+    } else {
+        job.transfers.push_back(file);
+    }
+    close(fd);
+    co_return true;
+}
+
+// 下载一个文件, 完成后设置修改时间
+netdisk::Task<bool> sync_download(netdisk::Client &client, sync_job &job, const sync_file &file) {
+    std::string local_path = job.local_dir + file.rel_path;
+    output_info("downloading file: " + local_path);
+    auto res = co_await client.download(job.remote_dir + file.rel_path, local_path);
+    for (int retries = 0; co_await sync_busy_wait(client, res, retries);) {
+        res = co_await client.download(job.remote_dir + file.rel_path, local_path);
+    }
+    if (!res.ok()) {
+        output_error("fail to download file: " + local_path + ": " + res.message);
+        co_return false;
+    }
+    struct timespec times[2] = {{0, UTIME_OMIT}, {file.mtime, 0}};
+    utimensat(AT_FDCWD, local_path.c_str(), times, 0);
+    output_info("downloaded file: " + local_path);
+    co_return true;
+}
+
+// 同步工作协程: 从共享列表中取文件处理, 返回失败数
+netdisk::Task<int> sync_worker(netdisk::Client &client, sync_job &job,
+                               netdisk::Task<bool> (*handle)(netdisk::Client &, sync_job &, const sync_file &)) {
+    int failed = 0;
+    while (job.next < job.files.size()) {
+        const sync_file &file = job.files[job.next++];
+        if (!co_await handle(client, job, file)) failed++;
+    }
+    co_return failed;
+}
+
+// 用有限的并发数处理job.files
+netdisk::Task<void> sync_run_parallel(netdisk::Client &client, sync_job &job, int workers,
+                                      netdisk::Task<bool> (*handle)(netdisk::Client &, sync_job &,
+                                                                    const sync_file &)) {
+    job.next = 0;
+    std::vector<netdisk::Task<int>> tasks;
+    for (int i = 0; i < workers && i < (int) job.files.size(); ++i) {
+        tasks.push_back(sync_worker(client, job, handle));
+    }
+    for (int failed: co_await netdisk::when_all(std::move(tasks))) job.failed += failed;
+}
+
+// 同步协程: 列出服务端目录, 计算缺失或变化的文件, 并行下载
+netdisk::Task<int> task_sync(netdisk::Client &client, sync_job &job, int jobs) {
+    auto listed = co_await client.list(job.remote_dir, 0);
+    for (int retries = 0; co_await sync_busy_wait(client, listed, retries);) {
+        listed = co_await client.list(job.remote_dir, 0);
+    }
+    if (!listed.ok()) {
+        output_error("fail to list remote dir: " + listed.message);
+        co_return 1;
+    }
+    auto &entries = listed.value;
+
+    // 先一次性创建所有目录(父目录的路径是子目录的前缀, 排序后先于子目录)
+    if (mkdir_recursive(job.local_dir) < 0) {
+        output_error("fail to make dir: " + job.local_dir);
+        co_return 1;
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const netdisk::Entry &a, const netdisk::Entry &b) { return a.path < b.path; });
+    std::vector<sync_file> hash_checks;
+    struct stat fileInfo{};
+    for (auto &entry: entries) {
+        std::string local_path = job.local_dir + entry.path;
+        if (entry.is_dir()) {
+            if (mkdir(local_path.c_str(), S_IRWXU) < 0 && errno != EEXIST) {
+                output_error("fail to make dir: " + local_path);
+                co_return 1;
+            }
+            continue;
+        }
+        // 比较大小和修改时间, 确定缺失或变化的文件
+        sync_file file = {entry.path, entry.size, entry.mtime};
+        if (stat(local_path.c_str(), &fileInfo) != 0 || fileInfo.st_size != entry.size) {
+            job.transfers.push_back(file);
+        } else if (job.use_hash) {
+            hash_checks.push_back(file);
+        } else if (fileInfo.st_mtim.tv_sec != entry.mtime) {
+            job.transfers.push_back(file);
+        }
+    }
+
+    // 大小相同的文件并行比较hash
+    if (!hash_checks.empty()) {
+        output_info("comparing hash of " + std::to_string(hash_checks.size()) + " files");
+        job.files = std::move(hash_checks);
+        co_await sync_run_parallel(client, job, jobs * SYNC_PIPELINE, sync_compare_hash);
     }
+
+    // 并行下载
+    output_info("sync plan: " + std::to_string(entries.size()) + " remote entries, " +
+                std::to_string(job.transfers.size()) + " files to download, " + std::to_string(jobs) + " jobs");
+    job.files = std::move(job.transfers);
+    job.transfers.clear();
+    co_await sync_run_parallel(client, job, jobs * SYNC_PIPELINE, sync_download);
+
+    if (job.failed > 0) {
+        output_warn("sync finished with " + std::to_string(job.failed) + " failures");
+        co_return 1;
+    }
+    output_info("sync finished");
+    co_return 0;
 }
 
-// 上传线程的封装参数
-struct param_upload {
-    int client_socket;
-    char *upload_to_path;
-    char *upload_from_path;
+// 同步结束后停止事件循环
+netdisk::Task<void> task_sync_main(netdisk::Client &client, sync_job &job, int jobs, int &code) {
+    code = co_await task_sync(client, job, jobs);
+    client.loop().stop();
+}
+
+// 同步函数(非交互): 把服务端目录镜像到本地目录
+// 用法: client sync <remote_dir/> <local_dir/> [-j N] [--hash]
+int func_sync(int argc, char *argv[]) {
+    if (argc < 4) {
+        output_hint("usage: client sync <remote_dir/> <local_dir/> [-j N] [--hash]");
+        return 2;
+    }
+    sync_job job;
+    job.remote_dir = argv[2];
+    job.local_dir = argv[3];
+    int jobs = SYNC_DEFAULT_JOBS;
+    for (int i = 4; i < argc; ++i) {
+        if (std::string(argv[i]) == "--hash") {
+            job.use_hash = true;
+        } else if (std::string(argv[i]) == "-j" && i + 1 < argc) {
+            jobs = std::max(1, atoi(argv[++i]));
+        } else {
+            output_error("unknown option: " + std::string(argv[i]));
+            return 2;
+        }
+    }
+    if (job.remote_dir == "./") job.remote_dir = "";
+    if (!job.remote_dir.empty() && *--job.remote_dir.end() != '/') job.remote_dir += '/';
+    if (*--job.local_dir.end() != '/') job.local_dir += '/';
+
+    // 连接池大小即并行传输数
+    netdisk::EventLoop loop;
+    netdisk::Client client(loop, {.host = SERVER_IP, .max_connections = jobs, .max_pipeline = SYNC_PIPELINE});
+    int code = 1;
+    loop.spawn(task_sync_main(client, job, jobs, code));
+    loop.run();
+    return code;
+}
+
+// 回放中一类请求的统计
+struct replay_stat {
+    std::vector<int64_t> latencies; // 回放时的耗时(微秒)
+    int64_t recorded = 0;           // 跟踪中服务端处理耗时之和(微秒)
+    int failed = 0;
+    int busy = 0;                   // 其中服务端繁忙(被拒绝)的请求数
+    int skipped = 0;                // 无法用客户端库重新发出而跳过的请求数
+};
+
+// 回放任务
+struct replay_job {
+    std::string scratch_dir;                             // 合成文件和下载文件的临时目录(以'/'结尾)
+    double speed = 1;                                    // 回放速度倍数
+    std::map<uint32_t, std::vector<TRACE_RECORD>> conns; // 连接编号 -> 请求(按时间排序)
+    std::vector<TRACE_RECORD> prepares;                  // 回放前需要在服务端存在的文件
+    size_t next = 0;                                     // 下一个要准备的文件下标
+    std::chrono::steady_clock::time_point start;         // 回放开始的时间
+    int64_t max_lag = 0;                                 // 请求晚于计划时间的最大值(微秒)
+    std::map<int, replay_stat> stats;                    // 请求类型 -> 统计
+    unsigned long downloads = 0;                         // 下载文件的编号
 };
 
-// 上传线程
-void *thread_upload(/*@ShouldBeFree*/ void *arg) {
-    auto p = (param_upload *) arg;
-
-    MSG up_file_msg = {0};
-    static int fd = -1;
-    ssize_t res = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    fd = open(p->upload_from_path, O_RDONLY);
-    if (fd < 0) {
-        output_error("fail to open file" + std::string(p->upload_from_path));
-        free(p->upload_to_path);
-        free(p->upload_from_path);
-        free(p);
-        return nullptr;
-    }
-
-    // 循环上传
-    output_info("uploading file: " + std::string(p->upload_from_path));
-    for (memset(buffer, 0, sizeof(buffer)), res = read_file_with_log(fd, buffer, sizeof(buffer), "read upload file"),
-                 up_file_msg.clear(), up_file_msg.type = MSG_TYPE_UPLOAD, strcpy(up_file_msg.fname, p->upload_to_path);
-         res > 0;
-         memset(buffer, 0, sizeof(buffer)), res = read_file_with_log(fd, buffer, sizeof(buffer), "read upload file"),
-                 up_file_msg.clear(), up_file_msg.type = MSG_TYPE_UPLOAD, strcpy(up_file_msg.fname,
-                                                                                 p->upload_to_path)) {
-
-        memcpy(up_file_msg.buffer, buffer, res);
-        up_file_msg.bytes = (int) res;
-        res = write_net_with_log(p->client_socket, &up_file_msg, sizeof(MSG), "upload file data");
-        // 延时防止服务端错乱
-        usleep(0.2 * 1000 * 1000);
-        if (res < 0) {
-            output_info("fail to upload");
-            break;
+// 旧协议的请求不能回放: 单层查询的回复没有结束标志, 旧上传协议的分块没有回复, 都无法和响应对应
+bool replay_skipped(int type) {
+    return type == MSG_TYPE_QUERY || type == MSG_TYPE_UPLOAD;
+}
+
+// 读取跟踪文件: 按连接分组, 合并旧上传协议的分块(跳过时按一次计数), 找出需要预先上传的文件
+int replay_load(const std::string &trace_path, replay_job &job) {
+    FILE *fp = fopen(trace_path.c_str(), "rb");
+    if (nullptr == fp) {
+        output_error("fail to open trace: " + trace_path);
+        return -1;
+    }
+    TRACE_HEADER header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(TRACE_RECORD)) {
+        output_error("invalid trace: " + trace_path);
+        fclose(fp);
+        return -1;
+    }
+    // 写线程按完成顺序写入, 末尾可能有不完整的记录
+    std::vector<TRACE_RECORD> records;
+    TRACE_RECORD record;
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        record.fname[sizeof(record.fname) - 1] = 0;
+        records.push_back(record);
+    }
+    fclose(fp);
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TRACE_RECORD &a, const TRACE_RECORD &b) { return a.time < b.time; });
+
+    std::set<std::string> uploaded, prepared;
+    for (auto &item: records) {
+        auto &list = job.conns[item.conn];
+        if (item.type == MSG_TYPE_UPLOAD_BULK) {
+            uploaded.insert(item.fname);
+        } else if ((item.type == MSG_TYPE_DOWNLOAD || item.type == MSG_TYPE_HASH) && item.size >= 0 &&
+                   !uploaded.count(item.fname) && prepared.insert(item.fname).second) {
+            job.prepares.push_back(item);
         }
+        // 旧上传协议每BUFFER_SIZE字节一条记录, 合并成一次请求
+        if (item.type == MSG_TYPE_UPLOAD && !list.empty() && list.back().type == MSG_TYPE_UPLOAD &&
+            list.back().bytes == BUFFER_SIZE && strcmp(list.back().fname, item.fname) == 0) {
+            list.back().size += item.size;
+            list.back().bytes = item.bytes;
+            list.back().duration += item.duration;
+            continue;
+        }
+        list.push_back(item);
     }
-    output_info("uploaded file: " + std::string(p->upload_from_path));
+    output_info("loaded trace: " + trace_path + " (" + std::to_string(records.size()) + " records, " +
+                std::to_string(job.conns.size()) + " connections)");
+    return 0;
+}
 
-    free(p->upload_to_path);
-    free(p->upload_from_path);
-    free(p);
-    return nullptr;
+// 生成合成文件(内容只由种子和大小决定), 返回本地路径, 失败返回空串
+std::string replay_make_file(replay_job &job, int64_t size, uint64_t seed) {
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx-%lld", (unsigned long long) seed, (long long) size);
+    std::string path = job.scratch_dir + name;
+    struct stat fileInfo{};
+    if (stat(path.c_str(), &fileInfo) == 0 && fileInfo.st_size == size) return path;
+
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd < 0) return "";
+    std::vector<uint64_t> block(HASH_BLOCK_SIZE / sizeof(uint64_t));
+    uint64_t state = seed | 1; // xorshift64的状态不能为0
+    for (int64_t done = 0; done < size;) {
+        for (auto &word: block) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            word = state;
+        }
+        size_t n = (size_t) std::min<int64_t>(size - done, HASH_BLOCK_SIZE);
+        if (write(fd, block.data(), n) != (ssize_t) n) {
+            close(fd);
+            unlink(path.c_str());
+            return "";
+        }
+        done += (int64_t) n;
+    }
+    close(fd);
+    return path;
 }
 
-// 上传函数
-void func_upload(int client_socket, pthread_t &pthread_id) {
-    std::string input;
-    char *upload_to_path, *upload_from_path;
+// 准备工作协程: 上传回放中会被读取、但跟踪中没有上传过的文件, 返回失败数
+netdisk::Task<int> replay_prepare_worker(netdisk::Client &client, replay_job &job) {
+    int failed = 0;
+    while (job.next < job.prepares.size()) {
+        const TRACE_RECORD &record = job.prepares[job.next++];
+        auto res = co_await client.upload(replay_make_file(job, record.size, record.seed), record.fname);
+        if (!res.ok()) {
+            output_error("fail to prepare file: " + std::string(record.fname) + ": " + res.message);
+            failed++;
+        }
+    }
+    co_return failed;
+}
+
+// 重新发出一个请求, 返回errno(0表示成功)
+netdisk::Task<int> replay_issue(netdisk::Client &client, replay_job &job, const TRACE_RECORD &record) {
+    std::string path = record.fname;
+    switch (record.type) {
+        case MSG_TYPE_QUERY_TREE: {
+            auto res = co_await client.list(path, record.flag, std::string(record.arg, strnlen(record.arg,
+                                                                                                sizeof(record.arg))));
+            co_return res.error;
+        }
+        case MSG_TYPE_DOWNLOAD: {
+            std::string local_path = job.scratch_dir + "download-" + std::to_string(job.downloads++);
+            auto res = co_await client.download(path, local_path);
+            unlink(local_path.c_str());
+            co_return res.error;
+        }
+        case MSG_TYPE_HASH: {
+            auto res = co_await client.hash(path);
+            co_return res.error;
+        }
+        case MSG_TYPE_SEARCH: {
+            uint64_t since;
+            memcpy(&since, record.arg, sizeof(since));
+            auto res = co_await client.search(record.flag, path, since);
+            co_return res.error;
+        }
+        case MSG_TYPE_UPLOAD_BULK: {
+            bool checksum = record.flag & UPLOAD_FLAG_CHECKSUM;
+            auto res = co_await client.upload(replay_make_file(job, record.size, record.seed), path, checksum);
+            co_return res.error;
+        }
+        default:
+            co_return EINVAL;
+    }
+}
 
-    // 注意: 需要占用的线程参数申请新的空间，避免多线程同时访问(不能设为全局变量)
+// 回放一个连接上的请求: 按计划时间依次发出(前一个没完成时顺延), 返回失败数
+netdisk::Task<int> replay_conn(netdisk::Client &client, replay_job &job, const std::vector<TRACE_RECORD> &records) {
+    int failed = 0;
+    for (auto &record: records) {
+        if (replay_skipped(record.type)) {
+            job.stats[record.type].skipped++;
+            continue;
+        }
+        auto due = job.start + std::chrono::microseconds((int64_t) ((double) record.time / job.speed));
+        co_await client.loop().sleep_until(due);
+        auto begin = std::chrono::steady_clock::now();
+        job.max_lag = std::max(job.max_lag,
+                               (int64_t) std::chrono::duration_cast<std::chrono::microseconds>(begin - due).count());
+        int error = co_await replay_issue(client, job, record);
+        auto &stat = job.stats[record.type];
+        stat.latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - begin).count());
+        stat.recorded += record.duration;
+        if (error != 0) {
+            // 繁忙是服务端的过载保护在起作用, 回放不重试, 只单独统计
+            if (error == EBUSY) stat.busy++;
+            stat.failed++;
+            failed++;
+        }
+    }
+    co_return failed;
+}
 
-    // 服务端目标路径
-    input = input_with_hint("please input the file_path(relative path) where upload to");
-    upload_to_path = (char *) malloc(sizeof(char) * ((QUERY_PATH + input).length() + 1));
-    strcpy(upload_to_path, (QUERY_PATH + input).c_str());
-    output_info("upload to file_path: " + std::string(upload_to_path));
+// 请求类型的名字
+std::string replay_type_name(int type) {
+    switch (type) {
+        case MSG_TYPE_QUERY:
+            return "query";
+        case MSG_TYPE_DOWNLOAD:
+            return "download";
+        case MSG_TYPE_UPLOAD:
+            return "upload";
+        case MSG_TYPE_QUERY_TREE:
+            return "query tree";
+        case MSG_TYPE_HASH:
+            return "hash";
+        case MSG_TYPE_SEARCH:
+            return "search";
+        case MSG_TYPE_UPLOAD_BULK:
+            return "upload bulk";
+        default:
+            return "type " + std::to_string(type);
+    }
+}
 
-    // 客户端文件路径
-    input = input_with_hint("please input the file_path(relative path) where upload from");
-    upload_from_path = (char *) malloc(sizeof(char) * ((UPLOAD_PATH + input).length() + 1));
-    strcpy(upload_from_path, (UPLOAD_PATH + input).c_str());
-    output_info("upload from file_path: " + std::string(upload_from_path));
+// 输出回放结果: 每类请求的耗时分布, 以及跟踪中服务端的平均处理耗时
+void replay_report(replay_job &job, int64_t elapsed) {
+    char line[256];
+    snprintf(line, sizeof(line), "replay finished in %.3f s (speed=%.2f, max lag=%.3f ms)",
+             (double) elapsed / 1e6, job.speed, (double) job.max_lag / 1e3);
+    output_info(line);
+    for (auto &item: job.stats) {
+        if (item.second.skipped > 0) {
+            output_warn(replay_type_name(item.first) + ": skipped " + std::to_string(item.second.skipped) +
+                        " requests (legacy protocol, not replayable)");
+        }
+        auto &latencies = item.second.latencies;
+        if (latencies.empty()) continue;
+        std::sort(latencies.begin(), latencies.end());
+        size_t n = latencies.size();
+        int64_t sum = 0;
+        for (int64_t latency: latencies) sum += latency;
+        snprintf(line, sizeof(line),
+                 "%-12s count=%zu failed=%d busy=%d avg=%.3f p50=%.3f p99=%.3f max=%.3f ms (traced server avg=%.3f ms)",
+                 replay_type_name(item.first).c_str(), n, item.second.failed, item.second.busy, (double) sum / (double) n / 1e3,
+                 (double) latencies[n / 2] / 1e3, (double) latencies[std::min(n - 1, n * 99 / 100)] / 1e3,
+                 (double) latencies[n - 1] / 1e3, (double) item.second.recorded / (double) n / 1e3);
+        output_info(line);
+    }
+}
+
+// 回放协程: 先准备文件, 再并发回放各个连接
+netdisk::Task<int> task_replay(netdisk::Client &client, replay_job &job) {
+    if (!job.prepares.empty()) {
+        output_info("preparing " + std::to_string(job.prepares.size()) + " files");
+        std::vector<netdisk::Task<int>> workers;
+        for (size_t i = 0; i < REPLAY_PREPARE_JOBS && i < job.prepares.size(); ++i) {
+            workers.push_back(replay_prepare_worker(client, job));
+        }
+        int failed = 0;
+        for (int n: co_await netdisk::when_all(std::move(workers))) failed += n;
+        if (failed > 0) output_warn("fail to prepare " + std::to_string(failed) + " files");
+    }
 
-    // 新建线程上传，避免阻塞
-    pthread_create(&pthread_id, nullptr, thread_upload,
-                   &(*((param_upload *) malloc(sizeof(param_upload))) =
-                             param_upload{client_socket, upload_to_path, upload_from_path}));
+    output_info("replaying " + std::to_string(job.conns.size()) + " connections");
+    job.start = std::chrono::steady_clock::now();
+    std::vector<netdisk::Task<int>> conns;
+    for (auto &item: job.conns) conns.push_back(replay_conn(client, job, item.second));
+    int failed = 0;
+    for (int n: co_await netdisk::when_all(std::move(conns))) failed += n;
+    replay_report(job, std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - job.start).count());
+    co_return failed > 0 ? 1 : 0;
+}
+
+// 回放结束后停止事件循环
+netdisk::Task<void> task_replay_main(netdisk::Client &client, replay_job &job, int &code) {
+    code = co_await task_replay(client, job);
+    client.loop().stop();
+}
+
+// 删除回放的临时目录
+void replay_cleanup(const std::string &scratch_dir) {
+    DIR *dp = opendir(scratch_dir.c_str());
+    if (nullptr == dp) return;
+    struct dirent *dir;
+    while (nullptr != (dir = readdir(dp))) {
+        if (dir->d_name[0] != '.') unlink((scratch_dir + dir->d_name).c_str());
+    }
+    closedir(dp);
+    rmdir(scratch_dir.c_str());
+}
+
+// 回放函数(非交互): 按服务端跟踪("./server --trace")中的时间重新发出请求, 输出耗时统计
+// 会向服务端上传合成文件(覆盖同名文件), 只能对测试用的服务端回放, 所以必须显式给出服务端地址
+// 用法: client replay <trace> <host> [speed]
+int func_replay(int argc, char *argv[]) {
+    if (argc < 4) {
+        output_hint("usage: client replay <trace> <host> [speed]");
+        return 2;
+    }
+    std::string host = argv[3];
+    if (inet_addr(host.c_str()) == INADDR_NONE) {
+        output_error("invalid host: " + host);
+        return 2;
+    }
+    replay_job job;
+    job.speed = argc > 4 ? atof(argv[4]) : 1;
+    if (job.speed <= 0) {
+        output_error("invalid speed: " + std::string(argv[4]));
+        return 2;
+    }
+    if (replay_load(argv[2], job) < 0) return 1;
+
+    // 合成文件都在回放前生成, 不计入耗时
+    char scratch_dir[] = "/tmp/netdisk_replay.XXXXXX";
+    if (nullptr == mkdtemp(scratch_dir)) {
+        output_error("fail to make dir: " + std::string(scratch_dir));
+        return 1;
+    }
+    job.scratch_dir = scratch_dir + std::string("/");
+    for (auto &item: job.conns) {
+        for (auto &record: item.second) {
+            if (record.type == MSG_TYPE_UPLOAD_BULK &&
+                replay_make_file(job, record.size, record.seed).empty()) {
+                output_error("fail to make file in: " + job.scratch_dir);
+                replay_cleanup(job.scratch_dir);
+                return 1;
+            }
+        }
+    }
 
+    // 每条消息的调试输出会影响耗时
+    log_level = std::min(log_level, 4);
+    // 每个跟踪中的连接对应一个连接(不在同一连接上流水线, 保持原来的并发度)
+    netdisk::EventLoop loop;
+    netdisk::Client client(loop, {.host = host,
+            .max_connections = std::clamp((int) job.conns.size(), 1, REPLAY_MAX_CONNECTIONS),
+            .max_pipeline = 1});
+    int code = 1;
+    loop.spawn(task_replay_main(client, job, code));
+    loop.run();
+    replay_cleanup(job.scratch_dir);
+    return code;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     printf("[Hello] I'm client!\n");
+    // 服务端关闭连接(繁忙或驱逐)后上传会写入已关闭的socket, 由返回的错误处理
+    signal(SIGPIPE, SIG_IGN);
 
-    // 初始化 client_socket
-    int client_socket = init_client_socket();
-    if (client_socket < 0) {
+    // 非交互的同步模式
+    if (argc >= 2 && std::string(argv[1]) == "sync") {
+        int code = func_sync(argc, argv);
         printf("[Goodbye]\n");
-        return 0;
+        return code;
+    }
+    // 非交互的回放模式
+    if (argc >= 2 && std::string(argv[1]) == "replay") {
+        int code = func_replay(argc, argv);
+        printf("[Goodbye]\n");
+        return code;
     }
 
-    // 创建接收专用线程
+    // 判断下载文件夹存在情况(只在启动时检查一次)
+    if (mkdir(DOWNLOAD_PATH, S_IRWXU) < 0) {
+        if (errno != EEXIST) {
+            output_error("fail to make dir");
+            return 0;
+        }
+    } else {
+        output_warn("dir no exist, auto created");
+    }
+
+    // 创建事件循环线程(连接在第一次操作时建立)
+    netdisk::EventLoop loop;
+    netdisk::Client client(loop, {.host = SERVER_IP});
     pthread_t pthread_id;
-    pthread_create(&pthread_id, nullptr, thread_receive, &client_socket);
+    pthread_create(&pthread_id, nullptr, thread_loop, &loop);
 
     // UI
     net_disk_ui();
 
     // 循环发送
-    MSG send_msg = {0};
     std::string command;
-    for (std::cin >> command; !std::cin.eof(); std::cin >> command, send_msg.clear()) {
+    for (std::cin >> command; !std::cin.eof() && command != "5"; std::cin >> command) {
 
         if (command == "\n") {
             continue;
@@ -421,25 +808,32 @@ int main() {
 
         switch (command[0]) {
             case '1':
-                func_query(client_socket, send_msg);
+                func_query(client);
                 break;
             case '2':
-                func_download(client_socket, send_msg);
+                func_download(client);
                 break;
             case '3':
-                func_upload(client_socket, pthread_id);
+                func_upload(client);
                 break;
             case '4':
                 system("clear");
                 net_disk_ui();
                 break;
-            case '5':
-                printf("[Goodbye]\n");
-                return 0;
+            case '6':
+                func_query_tree(client);
+                break;
+            case '7':
+                func_search(client);
+                break;
             default:
                 output_error("unknown command: " + command);
         }
     }
+
+    // 停止事件循环后再退出, 避免在其他线程中析构client
+    loop.stop();
+    pthread_join(pthread_id, nullptr);
     printf("[Goodbye]\n");
     return 0;
 }
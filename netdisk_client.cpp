@@ -0,0 +1,815 @@
+#include "netdisk_client.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+int log_level = 5;
+
+// * \033[0m：重置所有颜色和样式设置。
+// * \033[1;32m：设置文本颜色为绿色。:Hint
+// * \033[1;31m：设置文本颜色为红色。:Error
+// * \033[1;33m：设置文本颜色为黄色。:Warn
+// * \033[1;34m：设置文本颜色为蓝色。:Log Debug
+// * \033[1;35m：设置文本颜色为紫色。:Info
+// * \033[1;36m：设置文本颜色为青色。
+// * \033[1;37m：设置文本颜色为白色。:input
+
+// 输出提示语
+void output_hint(const std::string &hint) { // green, always output
+    if (!(log_level >= 1)) return;
+    std::cout << "\033[1;32m" << "[Hint] " << hint << "\033[0m" << std::endl << std::flush;
+}
+
+// 输出错误
+void output_error(const std::string &hint) { // red
+    if (!(log_level >= 2)) return;
+    std::cout << "\033[1;31m" << hint << ": perror=" << std::flush;
+    perror("");
+    std::cout << "\033[0m" << std::flush << "\033[0m" << std::flush;
+}
+
+// 输出警告
+void output_warn(const std::string &hint) { // yellow
+    if (!(log_level >= 3)) return;
+    std::cout << "\033[1;33m" << "[Warn] " << hint << "\033[0m" << std::endl << std::flush;
+}
+
+// 输出运行信息
+void output_info(const std::string &hint) { // purple
+    if (!(log_level >= 4)) return;
+    std::cout << "\033[1;35m" << "[Info] " << hint << "\033[0m" << std::endl << std::flush;
+}
+
+// 输出调试信息
+void output_debug(const std::string &hint) { // blue
+    if (!(log_level >= 5)) return;
+    std::cout << "\033[1;34m" << "[Debug] " << hint << "\033[0m" << std::endl << std::flush;
+}
+
+// buffer转string(转为十六进制显示)
+std::string buffer_to_string(char *buffer, size_t n) {
+    std::string tmp;
+    for (size_t i = 0; i < n; ++i) {
+        tmp += "\\0x";
+        tmp += (std::stringstream() << std::hex << std::setw(2) << std::setfill('0') << int(uint8_t(buffer[i]))).str();
+    }
+    return tmp;
+}
+
+// 用一段数据更新hash(64位FNV-1a, 与服务端一致)
+uint64_t hash_update(uint64_t hash, const char *buffer, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        hash = (hash ^ (uint8_t) buffer[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// 计算文件内容的hash
+int hash_file(int fd, uint64_t &hash) {
+    static thread_local char buffer[HASH_BLOCK_SIZE];
+    ssize_t res;
+    hash = HASH_INIT;
+    while ((res = read(fd, buffer, sizeof(buffer))) > 0) {
+        hash = hash_update(hash, buffer, res);
+    }
+    return res < 0 ? -1 : 0;
+}
+
+namespace netdisk {
+
+EventLoop::EventLoop() {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ < 0 || wake_fd_ < 0) {
+        output_error("fail to create event loop");
+        return;
+    }
+    struct epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+}
+
+EventLoop::~EventLoop() {
+    // 停止工作线程(还没执行的阻塞任务直接丢弃)
+    pthread_mutex_lock(&work_lock_);
+    work_stopped_ = true;
+    work_.clear();
+    pthread_cond_broadcast(&work_cond_);
+    pthread_mutex_unlock(&work_lock_);
+    for (pthread_t worker: workers_) pthread_join(worker, nullptr);
+    if (wake_fd_ >= 0) close(wake_fd_);
+    if (epoll_fd_ >= 0) close(epoll_fd_);
+}
+
+void EventLoop::run() {
+    struct epoll_event events[64];
+    pthread_mutex_lock(&post_lock_);
+    stopped_ = false;
+    pthread_mutex_unlock(&post_lock_);
+
+    while (true) {
+        // 其他线程投递的任务
+        std::vector<std::function<void()>> posted;
+        pthread_mutex_lock(&post_lock_);
+        posted.swap(posted_);
+        bool stopped = stopped_;
+        pthread_mutex_unlock(&post_lock_);
+        if (stopped) break;
+        for (auto &fn: posted) fn();
+
+        // 到期的定时器
+        auto now = std::chrono::steady_clock::now();
+        while (!timers_.empty() && timers_.begin()->first <= now) {
+            ready_.push_back(timers_.begin()->second);
+            timers_.erase(timers_.begin());
+        }
+
+        // 恢复协程(恢复过程中新加入的留到下一轮)
+        for (size_t n = ready_.size(); n > 0; --n) {
+            auto handle = ready_.front();
+            ready_.pop_front();
+            handle.resume();
+        }
+
+        int timeout = -1;
+        if (!ready_.empty()) {
+            timeout = 0;
+        } else if (!timers_.empty()) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    timers_.begin()->first - std::chrono::steady_clock::now()).count();
+            timeout = (int) std::max<long long>(0, wait + 1);
+        }
+        pthread_mutex_lock(&post_lock_);
+        if (!posted_.empty() || stopped_) timeout = 0;
+        pthread_mutex_unlock(&post_lock_);
+
+        int count = epoll_wait(epoll_fd_, events, 64, timeout);
+        if (count < 0 && errno != EINTR) {
+            output_error("epoll_wait error");
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == nullptr) {
+                uint64_t value;
+                while (read(wake_fd_, &value, sizeof(value)) > 0) {}
+                continue;
+            }
+            ((IoHandler *) events[i].data.ptr)->on_io(events[i].events);
+        }
+    }
+}
+
+void EventLoop::stop() {
+    pthread_mutex_lock(&post_lock_);
+    stopped_ = true;
+    pthread_mutex_unlock(&post_lock_);
+    uint64_t value = 1;
+    write(wake_fd_, &value, sizeof(value));
+}
+
+void EventLoop::post(std::function<void()> fn) {
+    pthread_mutex_lock(&post_lock_);
+    posted_.push_back(std::move(fn));
+    pthread_mutex_unlock(&post_lock_);
+    uint64_t value = 1;
+    write(wake_fd_, &value, sizeof(value));
+}
+
+void EventLoop::OffloadAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    EventLoop *self = loop;
+    pthread_mutex_lock(&self->work_lock_);
+    if (self->workers_.empty()) {
+        for (int i = 0; i < EVENT_LOOP_WORKERS; ++i) {
+            pthread_t worker;
+            if (pthread_create(&worker, nullptr, work_thread, self) == 0) self->workers_.push_back(worker);
+        }
+    }
+    self->work_.push_back([self, handle, fn = std::move(fn)] {
+        fn();
+        self->post([handle] { handle.resume(); });
+    });
+    pthread_cond_signal(&self->work_cond_);
+    pthread_mutex_unlock(&self->work_lock_);
+}
+
+void *EventLoop::work_thread(void *arg) {
+    auto self = (EventLoop *) arg;
+    while (true) {
+        pthread_mutex_lock(&self->work_lock_);
+        while (self->work_.empty() && !self->work_stopped_) pthread_cond_wait(&self->work_cond_, &self->work_lock_);
+        if (self->work_stopped_) {
+            pthread_mutex_unlock(&self->work_lock_);
+            return nullptr;
+        }
+        auto fn = std::move(self->work_.front());
+        self->work_.pop_front();
+        pthread_mutex_unlock(&self->work_lock_);
+        fn();
+    }
+}
+
+void EventLoop::spawn(Task<void> task) {
+    detail::start_detached(std::move(task));
+}
+
+void EventLoop::defer(std::coroutine_handle<> handle) {
+    ready_.push_back(handle);
+}
+
+int EventLoop::watch(int fd, uint32_t events, IoHandler *handler) {
+    struct epoll_event event{};
+    event.events = events;
+    event.data.ptr = handler;
+    return epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+}
+
+int EventLoop::modify(int fd, uint32_t events, IoHandler *handler) {
+    struct epoll_event event{};
+    event.events = events;
+    event.data.ptr = handler;
+    return epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event);
+}
+
+void EventLoop::unwatch(int fd) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+// 一个请求及其响应的处理状态
+struct Request {
+    MSG msg{};                         // 请求头
+    int body_fd = -1;                  // 批量上传的文件内容(用sendfile发送)
+    off_t body_offset = 0;
+    int64_t body_length = 0;
+    size_t header_offset = 0;          // 请求头已发送的字节数
+    int out_fd = -1;                   // 下载写入的文件
+    std::string out_path;              // 下载的目标路径
+    std::string tmp_path;              // 下载中的临时文件
+    std::vector<Entry> entries;        // 查询/搜索结果
+    uint64_t value = 0;                // hash/搜索的版本号
+    Status status;
+    bool done = false;                 // 结果已交给协程
+    bool discard = false;              // 已取消, 之后到达的响应直接丢弃
+    bool responded = false;            // 已收到响应的数据(之后连接断开不能重试)
+    int retries = 0;                   // 已在新连接上重试的次数
+    Connection *connection = nullptr;  // 分配到的连接
+    std::coroutine_handle<> waiter;
+    std::optional<std::stop_callback<std::function<void()>>> on_cancel;
+
+    bool sending() const { return header_offset > 0 || body_offset > 0; }
+
+    // 释放文件资源(失败时删除下载的临时文件)
+    void release(bool success) {
+        if (body_fd >= 0) close(body_fd);
+        body_fd = -1;
+        if (out_fd >= 0) {
+            close(out_fd);
+            if (!success) unlink(tmp_path.c_str());
+        }
+        out_fd = -1;
+    }
+};
+
+// 完成请求, 在下一轮循环中恢复等待的协程
+static void finish(EventLoop &loop, const std::shared_ptr<Request> &request, Status status) {
+    if (request->done) return;
+    request->done = true;
+    request->status = std::move(status);
+    request->release(request->status.ok());
+    if (request->waiter) loop.defer(request->waiter);
+}
+
+// 连接池中的一个连接: 请求按顺序发送, 响应按同样的顺序匹配(服务端按顺序处理)
+class Connection : public IoHandler {
+public:
+    Connection(Client &client, EventLoop &loop) : client_(client), loop_(loop) {}
+
+    ~Connection() {
+        if (fd_ >= 0) {
+            loop_.unwatch(fd_);
+            close(fd_);
+        }
+    }
+
+    // 非阻塞连接服务端
+    bool open(const ClientOptions &options) {
+        fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) {
+            output_error("fail to create socket");
+            return false;
+        }
+        int opt_value = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &opt_value, sizeof(opt_value));
+        struct sockaddr_in server_addr{};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = inet_addr(options.host.c_str());
+        server_addr.sin_port = htons(options.port);
+        if (connect(fd_, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+            output_error("fail to connect server!");
+            return false;
+        }
+        connecting_ = true;
+        loop_.watch(fd_, EPOLLIN | EPOLLOUT, this);
+        return true;
+    }
+
+    bool usable() const { return fd_ >= 0 && !closed_; }
+
+    size_t load() const { return queue_.size(); }
+
+    void enqueue(const std::shared_ptr<Request> &request) {
+        request->connection = this;
+        queue_.push_back(request);
+        if (!connecting_) flush();
+    }
+
+    // 取消请求: 未发送的直接移除, 已发送的丢弃响应, 发送到一半的只能断开连接
+    void cancel(const std::shared_ptr<Request> &request) {
+        auto it = std::find(queue_.begin(), queue_.end(), request);
+        if (it == queue_.end()) return;
+        size_t index = it - queue_.begin();
+        if (index > send_index_ || (index == send_index_ && !request->sending())) {
+            queue_.erase(it);
+            finish(loop_, request, Status{ECANCELED, "cancelled"});
+        } else if (index == send_index_) {
+            // 之后的请求还没发送, 放回客户端队列(保持顺序)由其他连接重新发送, 只有已发送的请求失败
+            for (size_t i = queue_.size(); i > index + 1; --i) {
+                queue_[i - 1]->connection = nullptr;
+                client_.pending_.push_front(queue_[i - 1]);
+            }
+            queue_.erase(queue_.begin() + (long) index + 1, queue_.end());
+            finish(loop_, request, Status{ECANCELED, "cancelled"});
+            fail(ECONNABORTED, "connection aborted by cancel");
+        } else {
+            request->discard = true;
+            finish(loop_, request, Status{ECANCELED, "cancelled"});
+        }
+    }
+
+    void on_io(uint32_t events) override {
+        if (closed_) return;
+        if (connecting_ && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0) {
+                errno = error;
+                output_error("fail to connect server!");
+                fail(error, "fail to connect server");
+                return;
+            }
+            connecting_ = false;
+            output_info("finish connecting server!");
+        }
+        if (events & EPOLLIN) receive();
+        if (!closed_ && (events & EPOLLOUT)) flush();
+        if (!closed_ && (events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+            fail(ECONNRESET, "connection lost");
+        }
+    }
+
+private:
+    // 发送队列中未发送的请求, 写满时等待EPOLLOUT
+    void flush() {
+        while (!closed_ && send_index_ < queue_.size()) {
+            auto &request = queue_[send_index_];
+            while (request->header_offset < sizeof(MSG)) {
+                ssize_t res = write(fd_, (char *) &request->msg + request->header_offset,
+                                    sizeof(MSG) - request->header_offset);
+                if (res < 0 && errno == EINTR) continue;
+                if (res < 0 && errno == EAGAIN) return want_write(true);
+                if (res < 0) return fail_send(errno, "fail to send msg");
+                request->header_offset += res;
+                if (request->header_offset == sizeof(MSG)) {
+                    output_debug("client => " + request->msg.toString() + " (" + std::to_string(sizeof(MSG)) +
+                                 " bytes)");
+                }
+            }
+            while (request->body_offset < request->body_length) {
+                ssize_t res = sendfile(fd_, request->body_fd, &request->body_offset,
+                                       request->body_length - request->body_offset);
+                if (res < 0 && errno == EINTR) continue;
+                if (res < 0 && errno == EAGAIN) return want_write(true);
+                if (res <= 0) return fail_send(res < 0 ? errno : EIO, "fail to upload");
+            }
+            // 文件在请求完成时才关闭, 连接断开后可以从头重新发送
+            ++send_index_;
+        }
+        want_write(false);
+    }
+
+    void want_write(bool enable) {
+        if (writing_ == enable || closed_) return;
+        writing_ = enable;
+        loop_.modify(fd_, EPOLLIN | (enable ? (uint32_t) EPOLLOUT : 0), this);
+    }
+
+    // 接收响应, 每凑满一个MSG处理一次; 水平触发, 处理READ_BUDGET条后让出, 剩下的数据下一轮继续读
+    void receive() {
+        int budget = READ_BUDGET;
+        while (!closed_ && budget > 0) {
+            ssize_t res = read(fd_, (char *) &incoming_ + incoming_offset_, sizeof(MSG) - incoming_offset_);
+            if (res < 0 && errno == EINTR) continue;
+            if (res < 0 && errno == EAGAIN) return;
+            if (res <= 0) return fail(res < 0 ? errno : ECONNRESET, "server finished connection");
+            if (!queue_.empty()) queue_.front()->responded = true;
+            incoming_offset_ += res;
+            if (incoming_offset_ == sizeof(MSG)) {
+                incoming_offset_ = 0;
+                --budget;
+                // 格式化整条信息开销很大, 不输出调试信息时跳过
+                if (log_level >= 5) {
+                    output_debug("client <= " + incoming_.toString() + " (" + std::to_string(sizeof(MSG)) + " bytes)");
+                }
+                handle(incoming_);
+            }
+        }
+    }
+
+    // 处理队首请求的一条响应
+    void handle(MSG &response) {
+        // 服务端过载时不处理请求, 回复繁忙后关闭连接(可能在请求发出之前), 所有请求都可以稍后重试
+        if (response.type == MSG_TYPE_BUSY) {
+            return fail(EBUSY, "server busy", response.flag);
+        }
+        if (queue_.empty() || send_index_ == 0) {
+            return fail(EPROTO, "unexpected msg type" + std::to_string(response.type));
+        }
+        auto request = queue_.front();
+        bool complete = false;
+        Status status;
+        if (response.type == MSG_TYPE_ERROR) {
+            complete = true;
+            status = Status{EREMOTEIO, response.fname};
+        } else if (response.type != request->msg.type) {
+            return fail(EPROTO, "unexpected msg type" + std::to_string(response.type));
+        } else {
+            switch (response.type) {
+                case MSG_TYPE_QUERY_TREE:
+                case MSG_TYPE_SEARCH:
+                    if (response.flag == QUERY_TREE_FLAG_END) {
+                        memcpy(&request->value, response.buffer, sizeof(request->value));
+                        complete = true;
+                    } else if (response.type == MSG_TYPE_SEARCH && response.flag == SEARCH_FLAG_RESYNC) {
+                        // 起点之前的墓碑已被服务端清除, 只能从0开始完全重新同步
+                        memcpy(&request->value, response.buffer, sizeof(request->value));
+                        complete = true;
+                        status = Status{ESTALE, "changes were compacted on server, full resync required"};
+                    } else if (response.type == MSG_TYPE_QUERY_TREE && response.flag == QUERY_TREE_FLAG_PACKED) {
+                        if (!request->discard && !unpack_tree(response, request->entries)) {
+                            return fail(EPROTO, "bad packed tree entries");
+                        }
+                    } else if (response.type == MSG_TYPE_SEARCH && response.flag == SEARCH_FLAG_PACKED) {
+                        if (!request->discard && !unpack_search(response, request->entries)) {
+                            return fail(EPROTO, "bad packed search entries");
+                        }
+                    } else if (!request->discard) {
+                        Entry entry;
+                        entry.path = response.fname;
+                        if (response.type == MSG_TYPE_SEARCH) {
+                            INDEX_ENTRY info;
+                            memcpy(&info, response.buffer, sizeof(info));
+                            entry.size = info.size;
+                            entry.mtime = info.mtime;
+                            entry.hash = info.hash;
+                            entry.generation = info.generation;
+                            entry.deleted = info.deleted != 0;
+                        } else {
+                            TREE_ENTRY info;
+                            memcpy(&info, response.buffer, sizeof(info));
+                            entry.size = info.size;
+                            entry.mtime = info.mtime;
+                        }
+                        request->entries.push_back(std::move(entry));
+                    }
+                    break;
+                case MSG_TYPE_DOWNLOAD:
+                    if (request->out_fd >= 0 && write(request->out_fd, response.buffer, response.bytes) < 0) {
+                        status = Status{errno, "fail to write file: " + request->tmp_path};
+                        request->release(false);
+                    }
+                    if (response.bytes < (int) sizeof(response.buffer)) {
+                        complete = true;
+                        if (status.ok() && request->out_fd >= 0) {
+                            close(request->out_fd);
+                            request->out_fd = -1;
+                            if (rename(request->tmp_path.c_str(), request->out_path.c_str()) < 0) {
+                                status = Status{errno, "fail to save file: " + request->out_path};
+                                unlink(request->tmp_path.c_str());
+                            }
+                        }
+                    }
+                    break;
+                case MSG_TYPE_HASH:
+                    memcpy(&request->value, response.buffer, sizeof(request->value));
+                    complete = true;
+                    break;
+                default:
+                    complete = true;
+            }
+        }
+        if (!complete) return;
+        queue_.pop_front();
+        --send_index_;
+        finish(loop_, request, std::move(status));
+        client_.dispatch();
+    }
+
+    // 解析打包的递归查询结果(TREE_PACKED_ENTRY后紧跟路径, 按8字节对齐), 格式错误返回false
+    static bool unpack_tree(const MSG &response, std::vector<Entry> &entries) {
+        size_t end = response.bytes, pos = 0;
+        if (response.bytes < 0 || end > sizeof(response.fname)) return false;
+        while (pos < end) {
+            TREE_PACKED_ENTRY info;
+            if (end - pos < sizeof(info)) return false;
+            memcpy(&info, response.fname + pos, sizeof(info));
+            if (info.name_len < 0 || end - pos - sizeof(info) < (size_t) info.name_len) return false;
+            Entry entry;
+            entry.path.assign(response.fname + pos + sizeof(info), info.name_len);
+            entry.size = info.size;
+            entry.mtime = info.mtime;
+            entries.push_back(std::move(entry));
+            pos += (sizeof(info) + info.name_len + 7) & ~(size_t) 7;
+        }
+        return true;
+    }
+
+    // 解析打包的搜索结果(SEARCH_PACKED_ENTRY后紧跟路径, 按8字节对齐), 格式错误返回false
+    static bool unpack_search(const MSG &response, std::vector<Entry> &entries) {
+        size_t end = response.bytes, pos = 0;
+        if (response.bytes < 0 || end > sizeof(response.fname)) return false;
+        while (pos < end) {
+            SEARCH_PACKED_ENTRY info;
+            if (end - pos < sizeof(info)) return false;
+            memcpy(&info, response.fname + pos, sizeof(info));
+            if (info.name_len < 0 || end - pos - sizeof(info) < (size_t) info.name_len) return false;
+            Entry entry;
+            entry.path.assign(response.fname + pos + sizeof(info), info.name_len);
+            entry.size = info.entry.size;
+            entry.mtime = info.entry.mtime;
+            entry.hash = info.entry.hash;
+            entry.generation = info.entry.generation;
+            entry.deleted = info.entry.deleted != 0;
+            entries.push_back(std::move(entry));
+            pos += (sizeof(info) + info.name_len + 7) & ~(size_t) 7;
+        }
+        return true;
+    }
+
+    // 发送失败: 服务端可能已经回复繁忙并关闭了连接, 先读出回复, 让请求按繁忙处理
+    void fail_send(int error, const std::string &message) {
+        receive();
+        fail(error, message);
+    }
+
+    // 连接失败: 还没收到响应的请求(如服务端驱逐了空闲连接)放回客户端队列在新连接上重试,
+    // 其他未完成的请求返回错误, 连接从池中移除; 繁忙和协议错误不重试
+    void fail(int error, const std::string &message, int retry_after = 0) {
+        if (closed_) return;
+        closed_ = true;
+        loop_.unwatch(fd_);
+        auto queue = std::move(queue_);
+        queue_.clear();
+        bool retry = error != EBUSY && error != EPROTO;
+        std::deque<std::shared_ptr<Request>> retried;
+        for (auto &request: queue) {
+            if (retry && !request->done && !request->responded && request->retries < REQUEST_RETRIES) {
+                request->retries++;
+                request->header_offset = 0;
+                request->body_offset = 0;
+                request->connection = nullptr;
+                retried.push_back(request);
+            } else {
+                finish(loop_, request, Status{error, message, retry_after});
+            }
+        }
+        if (!retried.empty()) output_warn(message + ", retry " + std::to_string(retried.size()) + " requests");
+        client_.pending_.insert(client_.pending_.begin(), retried.begin(), retried.end());
+        if (error == EBUSY) client_.busy(retry_after);
+        client_.remove(this);
+    }
+
+    Client &client_;
+    EventLoop &loop_;
+    int fd_ = -1;
+    bool connecting_ = false;
+    bool writing_ = true;                          // 是否在监听EPOLLOUT
+    bool closed_ = false;
+    std::deque<std::shared_ptr<Request>> queue_;   // 未完成的请求(队首等待响应)
+    size_t send_index_ = 0;                        // queue_中第一个未发送完的请求
+    MSG incoming_{};                               // 接收中的响应
+    size_t incoming_offset_ = 0;
+};
+
+// 等待请求完成
+struct RequestAwaiter {
+    Client *client;
+    std::shared_ptr<Request> request;
+    std::stop_token token;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        request->waiter = handle;
+        client->submit(request);
+        // 注册取消回调(已经取消时会立即调用)
+        Client *c = client;
+        std::weak_ptr<Request> weak = request;
+        request->on_cancel.emplace(token, std::function<void()>([c, weak] {
+            if (auto r = weak.lock()) c->cancel(r);
+        }));
+    }
+
+    Status await_resume() { return request->status; }
+};
+
+Client::Client(EventLoop &loop, ClientOptions options) : loop_(loop), options_(std::move(options)) {}
+
+Client::~Client() {
+    for (auto &request: pending_) finish(loop_, request, Status{ECANCELED, "client destroyed"});
+}
+
+void Client::submit(const std::shared_ptr<Request> &request) {
+    pending_.push_back(request);
+    dispatch();
+}
+
+void Client::dispatch() {
+    // 服务端繁忙期间不超过当时仍存活的连接数
+    int max_connections = options_.max_connections;
+    if (busy_limit_ > 0 && std::chrono::steady_clock::now() < busy_until_) {
+        max_connections = std::min(max_connections, busy_limit_);
+    } else {
+        busy_limit_ = 0;
+    }
+    while (!pending_.empty()) {
+        // 选择未完成请求最少的连接, 都满时新建连接
+        Connection *best = nullptr;
+        for (auto &connection: connections_) {
+            if (connection->usable() && connection->load() < (size_t) options_.max_pipeline &&
+                (best == nullptr || connection->load() < best->load())) {
+                best = connection.get();
+            }
+        }
+        if ((best == nullptr || best->load() > 0) && (int) connections_.size() < max_connections) {
+            auto connection = std::make_unique<Connection>(*this, loop_);
+            if (!connection->open(options_)) {
+                auto request = pending_.front();
+                pending_.pop_front();
+                finish(loop_, request, Status{errno ? errno : ECONNREFUSED, "fail to connect server"});
+                continue;
+            }
+            best = connection.get();
+            connections_.push_back(std::move(connection));
+        }
+        if (best == nullptr) return;
+        auto request = pending_.front();
+        pending_.pop_front();
+        best->enqueue(request);
+    }
+}
+
+void Client::cancel(const std::shared_ptr<Request> &request) {
+    if (request->done) return;
+    auto it = std::find(pending_.begin(), pending_.end(), request);
+    if (it != pending_.end()) {
+        pending_.erase(it);
+        finish(loop_, request, Status{ECANCELED, "cancelled"});
+    } else if (request->connection != nullptr) {
+        request->connection->cancel(request);
+    }
+}
+
+void Client::busy(int retry_after) {
+    // 被拒绝的连接还在池中, 不计入; 至少保留一个连接
+    int alive = std::max(1, (int) connections_.size() - 1);
+    auto now = std::chrono::steady_clock::now();
+    busy_limit_ = busy_limit_ > 0 && now < busy_until_ ? std::min(busy_limit_, alive) : alive;
+    busy_until_ = std::max(busy_until_, now + std::chrono::milliseconds(retry_after));
+}
+
+void Client::remove(Connection *connection) {
+    for (auto it = connections_.begin(); it != connections_.end(); ++it) {
+        if (it->get() == connection) {
+            // 本轮事件处理结束后再释放
+            auto owned = std::make_shared<std::unique_ptr<Connection>>(std::move(*it));
+            connections_.erase(it);
+            loop_.post([owned] {});
+            break;
+        }
+    }
+    dispatch();
+}
+
+// 新建请求头
+static std::shared_ptr<Request> make_request(int type, const std::string &fname) {
+    auto request = std::make_shared<Request>();
+    request->msg.clear();
+    request->msg.type = type;
+    strncpy(request->msg.fname, fname.c_str(), sizeof(request->msg.fname) - 1);
+    return request;
+}
+
+Task<Result<std::vector<Entry>>> Client::list(const std::string &path, int depth, const std::string &filter,
+                                              std::stop_token token) {
+    auto request = make_request(MSG_TYPE_QUERY_TREE, path);
+    request->msg.flag = depth;
+    strncpy(request->msg.buffer, filter.c_str(), sizeof(request->msg.buffer) - 1);
+    request->msg.bytes = (int) strlen(request->msg.buffer);
+
+    Result<std::vector<Entry>> result;
+    RequestAwaiter awaiter{this, request, std::move(token)};
+    Status status = co_await awaiter;
+    (Status &) result = status;
+    if (result.ok()) result.value = std::move(request->entries);
+    co_return result;
+}
+
+Task<Status> Client::download(const std::string &remote_path, const std::string &local_path,
+                              std::stop_token token) {
+    auto request = make_request(MSG_TYPE_DOWNLOAD, remote_path);
+    request->out_path = local_path;
+    request->tmp_path = local_path + ".part";
+    request->out_fd = ::open(request->tmp_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+    if (request->out_fd < 0) {
+        co_return Status{errno, "can't open file: " + request->tmp_path};
+    }
+    RequestAwaiter awaiter{this, request, std::move(token)};
+    Status status = co_await awaiter;
+    co_return status;
+}
+
+Task<Status> Client::upload(const std::string &local_path, const std::string &remote_path, bool checksum,
+                            std::stop_token token) {
+    auto request = make_request(MSG_TYPE_UPLOAD_BULK, remote_path);
+    struct stat fileInfo{};
+    request->body_fd = ::open(local_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (request->body_fd < 0 || fstat(request->body_fd, &fileInfo) != 0) {
+        int error = errno;
+        request->release(false);
+        co_return Status{error, "fail to open file: " + local_path};
+    }
+    UPLOAD_HEADER header = {fileInfo.st_size, 0};
+    if (checksum) {
+        // 计算hash会阻塞, 在工作线程中进行
+        int fd = request->body_fd, res = -1, error = 0;
+        auto hashing = loop_.offload([fd, &res, &error, &header] {
+            res = hash_file(fd, header.hash) < 0 || lseek(fd, 0, SEEK_SET) < 0 ? -1 : 0;
+            error = errno;
+        });
+        co_await hashing;
+        if (res < 0) {
+            request->release(false);
+            co_return Status{error, "fail to hash file: " + local_path};
+        }
+        request->msg.flag = UPLOAD_FLAG_CHECKSUM;
+    }
+    memcpy(request->msg.buffer, &header, sizeof(header));
+    request->msg.bytes = sizeof(header);
+    request->body_length = header.length;
+    RequestAwaiter awaiter{this, request, std::move(token)};
+    Status status = co_await awaiter;
+    co_return status;
+}
+
+Task<Result<uint64_t>> Client::hash(const std::string &remote_path, std::stop_token token) {
+    auto request = make_request(MSG_TYPE_HASH, remote_path);
+    Result<uint64_t> result;
+    RequestAwaiter awaiter{this, request, std::move(token)};
+    Status status = co_await awaiter;
+    (Status &) result = status;
+    result.value = request->value;
+    co_return result;
+}
+
+Task<Result<SearchResult>> Client::search(int mode, const std::string &pattern, uint64_t since,
+                                          std::stop_token token) {
+    auto request = make_request(MSG_TYPE_SEARCH, pattern);
+    request->msg.flag = mode;
+    if (mode == SEARCH_CHANGED) {
+        memcpy(request->msg.buffer, &since, sizeof(since));
+        request->msg.bytes = sizeof(since);
+    }
+    Result<SearchResult> result;
+    RequestAwaiter awaiter{this, request, std::move(token)};
+    Status status = co_await awaiter;
+    (Status &) result = status;
+    result.value.generation = request->value;
+    if (result.ok()) result.value.entries = std::move(request->entries);
+    co_return result;
+}
+
+}
@@ -0,0 +1,575 @@
+// 网盘客户端库: 协议定义, 日志, 以及基于C++20协程的异步客户端
+//
+// 所有网络操作都在一个事件循环线程中完成:
+//     netdisk::EventLoop loop;
+//     netdisk::Client client(loop, {.host = "127.0.0.1"});
+//     loop.spawn([](netdisk::Client &c) -> netdisk::Task<void> {
+//         auto res = co_await c.list("", 1);
+//         ...
+//     }(client));
+//     loop.run();
+// EventLoop的post()/stop()可以在其他线程调用, 其余接口只能在事件循环线程中调用.
+// 连接在收到响应之前被服务端关闭(如空闲超时被驱逐)时, 请求自动在新连接上重试一次.
+// 编译需要-std=c++20(GCC 11+), 使用者和netdisk_client.cpp一起链接, 见README.
+// 计算本地文件hash等阻塞操作用offload()交给工作线程, 不要直接在协程中执行.
+
+#ifndef NETDISK_CLIENT_H
+#define NETDISK_CLIENT_H
+
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <pthread.h>
+#include <stop_token>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <utility>
+#include <vector>
+
+#define MSG_TYPE_QUERY    1      // 查询
+#define MSG_TYPE_DOWNLOAD 2      // 下载
+#define MSG_TYPE_UPLOAD   3      // 上传
+#define MSG_TYPE_ERROR    4      // 错误
+#define MSG_TYPE_QUERY_TREE 5    // 递归查询(flag=最大深度, buffer=文件名过滤)
+#define MSG_TYPE_HASH     6      // 文件内容hash(回复的buffer=uint64_t)
+#define MSG_TYPE_SEARCH   7      // 搜索索引(flag=搜索方式, fname=模式)
+#define MSG_TYPE_UPLOAD_BULK 8   // 批量上传(buffer=UPLOAD_HEADER, 之后紧跟文件内容)
+#define MSG_TYPE_BUSY     9      // 服务端繁忙(flag=建议的重试间隔(毫秒), 之后服务端关闭连接)
+
+#define QUERY_TREE_FLAG_END 1    // 递归查询结束标志(服务端回复的flag)
+#define QUERY_TREE_FLAG_PACKED 2 // 递归查询结果打包(服务端回复的flag, 见TREE_PACKED_ENTRY)
+#define SEARCH_FLAG_END   1      // 搜索结束标志(服务端回复的flag, buffer=当前版本号)
+#define SEARCH_FLAG_PACKED 2     // 搜索结果打包(服务端回复的flag, 见SEARCH_PACKED_ENTRY)
+#define SEARCH_FLAG_RESYNC 3     // 变化查询的起点早于已清除的墓碑, 需要完全重新同步(服务端回复的flag, buffer=当前版本号, 之后没有结束标志)
+
+#define UPLOAD_FLAG_CHECKSUM 1   // 批量上传需要校验hash(请求的flag)
+
+#define SEARCH_PREFIX     0      // 路径前缀
+#define SEARCH_GLOB       1      // 路径通配符(fnmatch)
+#define SEARCH_SUBSTRING  2      // 路径子串
+#define SEARCH_CHANGED    3      // 版本号大于N的变化(buffer=uint64_t N, 包括已删除的)
+
+#define BUFFER_SIZE       1024   // buffer最大大小
+#define NAME_SIZE         FILENAME_MAX     // 文件名(路径)最大大小(需与服务端一致)
+#define HASH_BLOCK_SIZE   (64 * 1024) // 计算hash时每次读取的大小
+#define HASH_INIT         0xcbf29ce484222325ULL // FNV-1a初始值
+#define TRACE_MAGIC       "NDTRACE1" // 请求跟踪文件标识(服务端"--trace"生成)
+#define TRACE_ARG_SIZE    32     // 跟踪记录中保留的请求buffer长度(需与服务端一致)
+#define TRACE_NAME_SIZE   176    // 跟踪记录中保留的路径长度(需与服务端一致)
+#define EVENT_LOOP_WORKERS 4     // 事件循环执行阻塞任务(offload)的工作线程数
+#define REQUEST_RETRIES   1      // 连接在收到响应之前断开时, 请求在新连接上重试的次数
+#define READ_BUDGET       64     // 每次可读事件一个连接最多处理的响应数(超出的下一轮再读, 避免饿死其他连接)
+
+/**
+ * 1: Hint
+ * 2: Error
+ * 3: Warn
+ * 4: Info
+ * 5: Debug
+ */
+extern int log_level;
+
+// 输出提示语
+void output_hint(const std::string &hint);
+
+// 输出错误
+void output_error(const std::string &hint);
+
+// 输出警告
+void output_warn(const std::string &hint);
+
+// 输出运行信息
+void output_info(const std::string &hint);
+
+// 输出调试信息
+void output_debug(const std::string &hint);
+
+// buffer转string(转为十六进制显示)
+std::string buffer_to_string(char *buffer, size_t n);
+
+// 用于传递信息
+typedef struct msg {
+    int type;
+    int flag;
+    char buffer[BUFFER_SIZE];
+    char fname[NAME_SIZE];
+    int bytes;
+
+    // 用于输出信息
+    std::string toString() {
+        std::stringstream ss;
+        // 打包的结果在fname中, bytes是打包的长度, 可能超过buffer大小; 只输出buffer内的部分
+        auto buffer_copy = buffer_to_string(buffer, std::min<size_t>(std::max(bytes, 0), sizeof(buffer)));
+        if (type == -1) {
+            output_warn("get empty msg");
+        }
+        if (type == 0) {
+            output_warn("get empty msg");
+        }
+        ss << "msg{"
+           << ".type=" << type << ", "
+           << ".flag=" << flag << ", "
+           << ".buffer=" << R"(")" << buffer_copy << R"(")" << ", "
+           << ".fname=" << R"(")" << fname << R"(")" << ", "
+           << ".bytes=" << bytes << "}";
+        return ss.str();
+    }
+
+    // 清空结构体
+    void clear() {
+        type = -1;
+        flag = 0;
+        memset(buffer, 0, sizeof buffer);
+        memset(fname, 0, sizeof fname);
+        bytes = 0;
+    }
+} MSG;
+
+// 递归查询结果中的文件信息(放在MSG的buffer中)
+typedef struct tree_entry {
+    int64_t size;  // 文件大小
+    int64_t mtime; // 修改时间(秒)
+} TREE_ENTRY;
+
+// 打包的递归查询结果(QUERY_TREE_FLAG_PACKED): 多个条目依次放在MSG的fname中, bytes为总长度
+// 每个条目是TREE_PACKED_ENTRY后紧跟路径(不含'\0'), 整体按8字节对齐
+typedef struct tree_packed_entry {
+    int64_t size;     // 文件大小
+    int64_t mtime;    // 修改时间(秒)
+    int32_t name_len; // 路径长度
+    int32_t reserved;
+} TREE_PACKED_ENTRY;
+
+// 索引中的文件信息
+typedef struct index_entry {
+    int64_t size;        // 文件大小
+    int64_t mtime;       // 修改时间(秒)
+    uint64_t hash;       // 文件内容hash(目录为0)
+    uint64_t generation; // 最后一次变化时的版本号
+    int32_t deleted;     // 已删除(只出现在变化查询中)
+    int32_t reserved;
+} INDEX_ENTRY;
+
+// 打包的搜索结果(SEARCH_FLAG_PACKED): 和递归查询一样放在MSG的fname中, bytes为总长度
+// 每个条目是SEARCH_PACKED_ENTRY后紧跟路径(不含'\0'), 整体按8字节对齐
+typedef struct search_packed_entry {
+    INDEX_ENTRY entry;
+    int32_t name_len; // 路径长度
+    int32_t reserved;
+} SEARCH_PACKED_ENTRY;
+
+// 批量上传的头部信息(放在MSG的buffer中)
+typedef struct upload_header {
+    int64_t length; // 文件内容长度
+    uint64_t hash;  // 文件内容hash(flag带UPLOAD_FLAG_CHECKSUM时校验)
+} UPLOAD_HEADER;
+
+// 请求跟踪文件头
+typedef struct trace_header {
+    char magic[8];        // TRACE_MAGIC
+    uint32_t record_size; // sizeof(TRACE_RECORD)
+    uint32_t reserved;
+    int64_t start_time;   // 开始跟踪的时间(unix时间, 微秒)
+} TRACE_HEADER;
+
+// 请求跟踪记录(固定大小; 不记录文件内容, 只记录大小和用于生成合成内容的种子)
+typedef struct trace_record {
+    int64_t time;                // 收到请求的时间(相对开始跟踪, 微秒)
+    int64_t duration;            // 服务端处理耗时(微秒)
+    int64_t size;                // 文件大小(上传/下载/hash, 文件不存在为-1), 其他请求为0
+    uint64_t seed;               // 合成文件内容的种子
+    uint32_t conn;               // 连接编号(同一连接上的请求按顺序处理)
+    int32_t type;                // 请求类型
+    int32_t flag;                // 请求的flag
+    int32_t bytes;               // 请求的bytes
+    char arg[TRACE_ARG_SIZE];    // 请求buffer的开头(递归查询的过滤, 变化查询的版本号), 上传时为空
+    char fname[TRACE_NAME_SIZE]; // 请求路径
+} TRACE_RECORD;
+
+// 用一段数据更新hash(64位FNV-1a, 与服务端一致)
+uint64_t hash_update(uint64_t hash, const char *buffer, size_t n);
+
+// 计算文件内容的hash
+int hash_file(int fd, uint64_t &hash);
+
+namespace netdisk {
+
+// 操作状态(error为errno, 0表示成功)
+struct Status {
+    int error = 0;
+    std::string message;
+    int retry_after = 0; // 服务端繁忙(EBUSY)时建议的重试间隔(毫秒)
+
+    bool ok() const { return error == 0; }
+};
+
+// 带返回值的操作结果
+template<typename T>
+struct Result : Status {
+    T value{};
+};
+
+// 目录项/搜索结果(目录的path以'/'结尾)
+struct Entry {
+    std::string path;
+    int64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t hash = 0;       // 只有搜索结果有
+    uint64_t generation = 0; // 只有搜索结果有
+    bool deleted = false;    // 只有变化查询有
+
+    bool is_dir() const { return !path.empty() && path.back() == '/'; }
+};
+
+// 搜索结果
+struct SearchResult {
+    std::vector<Entry> entries;
+    uint64_t generation = 0; // 服务端当前版本号, 下次变化查询从这里开始
+};
+
+template<typename T = void>
+class Task;
+
+namespace detail {
+
+// 协程的公共部分: 惰性启动, 结束时恢复等待者
+struct PromiseBase {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            return handle.promise().continuation;
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() noexcept { std::terminate(); }
+};
+
+// 不被等待的协程(结束时自动销毁)
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() noexcept { return {}; }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+
+        std::suspend_never final_suspend() noexcept { return {}; }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+}
+
+// 协程任务: co_await时才开始执行
+template<typename T>
+class Task {
+public:
+    struct promise_type : detail::PromiseBase {
+        std::optional<T> value;
+
+        Task get_return_object() noexcept { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+        void return_value(T v) { value = std::move(v); }
+    };
+
+    Task(Task &&other) noexcept: handle_(std::exchange(other.handle_, {})) {}
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            if (handle_) handle_.destroy();
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+
+    ~Task() { if (handle_) handle_.destroy(); }
+
+    bool await_ready() noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+        handle_.promise().continuation = continuation;
+        return handle_;
+    }
+
+    T await_resume() { return std::move(*handle_.promise().value); }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+template<>
+class Task<void> {
+public:
+    struct promise_type : detail::PromiseBase {
+        Task get_return_object() noexcept { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+        void return_void() noexcept {}
+    };
+
+    Task(Task &&other) noexcept: handle_(std::exchange(other.handle_, {})) {}
+
+    ~Task() { if (handle_) handle_.destroy(); }
+
+    bool await_ready() noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+        handle_.promise().continuation = continuation;
+        return handle_;
+    }
+
+    void await_resume() noexcept {}
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+// 启动一个不被等待的任务
+inline Detached start_detached(Task<void> task) {
+    co_await task;
+}
+
+// when_all的共享状态
+template<typename T>
+struct WhenAllState {
+    size_t remaining = 0;
+    std::coroutine_handle<> waiter;
+    std::vector<T> results;
+};
+
+// state由when_all的协程帧持有, 恢复等待者之后不能再访问
+template<typename T>
+Task<void> when_all_child(Task<T> task, WhenAllState<T> *state, size_t i) {
+    state->results[i] = co_await task;
+    if (--state->remaining == 0) state->waiter.resume();
+}
+
+}
+
+// 同时执行多个任务, 全部完成后返回各自的结果
+template<typename T>
+Task<std::vector<T>> when_all(std::vector<Task<T>> tasks) {
+    detail::WhenAllState<T> state;
+    state.results.resize(tasks.size());
+
+    struct Awaiter {
+        std::vector<Task<T>> &tasks;
+        detail::WhenAllState<T> *state;
+
+        bool await_ready() noexcept { return tasks.empty(); }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            state->waiter = handle;
+            // 多计一个, 防止子任务同步完成时提前恢复
+            state->remaining = tasks.size() + 1;
+            for (size_t i = 0; i < tasks.size(); ++i) {
+                detail::start_detached(detail::when_all_child(std::move(tasks[i]), state, i));
+            }
+            return --state->remaining != 0;
+        }
+
+        void await_resume() noexcept {}
+    };
+    Awaiter awaiter{tasks, &state};
+    co_await awaiter;
+    co_return std::move(state.results);
+}
+
+// 事件循环中fd的事件处理者
+class IoHandler {
+public:
+    virtual void on_io(uint32_t events) = 0;
+
+protected:
+    ~IoHandler() = default;
+};
+
+// 单线程事件循环(epoll)
+class EventLoop {
+public:
+    EventLoop();
+
+    ~EventLoop();
+
+    EventLoop(const EventLoop &) = delete;
+
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    // 运行直到stop()
+    void run();
+
+    // 停止事件循环(线程安全)
+    void stop();
+
+    // 在事件循环线程中执行fn(线程安全)
+    void post(std::function<void()> fn);
+
+    // 启动一个协程, 不等待其结果
+    void spawn(Task<void> task);
+
+    // 下一轮循环中恢复协程
+    void defer(std::coroutine_handle<> handle);
+
+    // 等待一段时间
+    struct SleepAwaiter {
+        EventLoop *loop;
+        std::chrono::steady_clock::time_point deadline;
+
+        bool await_ready() const noexcept { return deadline <= std::chrono::steady_clock::now(); }
+
+        void await_suspend(std::coroutine_handle<> handle) { loop->timers_.emplace(deadline, handle); }
+
+        void await_resume() noexcept {}
+    };
+
+    SleepAwaiter sleep_for(std::chrono::milliseconds duration) {
+        return SleepAwaiter{this, std::chrono::steady_clock::now() + duration};
+    }
+
+    SleepAwaiter sleep_until(std::chrono::steady_clock::time_point deadline) {
+        return SleepAwaiter{this, deadline};
+    }
+
+    // 在工作线程中执行阻塞的fn, 完成后在事件循环线程中恢复协程
+    // (fn可以引用协程中的局部变量; awaiter需要绑定到具名变量再co_await)
+    struct OffloadAwaiter {
+        EventLoop *loop;
+        std::function<void()> fn;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> handle);
+
+        void await_resume() noexcept {}
+    };
+
+    OffloadAwaiter offload(std::function<void()> fn) {
+        return OffloadAwaiter{this, std::move(fn)};
+    }
+
+    // 注册/修改/取消fd的监听
+    int watch(int fd, uint32_t events, IoHandler *handler);
+
+    int modify(int fd, uint32_t events, IoHandler *handler);
+
+    void unwatch(int fd);
+
+private:
+    int epoll_fd_;
+    int wake_fd_;                                  // 用于post/stop唤醒epoll_wait
+    bool stopped_ = false;
+    pthread_mutex_t post_lock_ = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<std::function<void()>> posted_;    // 其他线程投递的任务
+    std::deque<std::coroutine_handle<>> ready_;    // 待恢复的协程
+    std::multimap<std::chrono::steady_clock::time_point, std::coroutine_handle<>> timers_;
+    pthread_mutex_t work_lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t work_cond_ = PTHREAD_COND_INITIALIZER;
+    bool work_stopped_ = false;
+    std::deque<std::function<void()>> work_;      // 等待工作线程执行的阻塞任务
+    std::vector<pthread_t> workers_;              // 工作线程(第一次offload时创建)
+
+    static void *work_thread(void *arg);
+};
+
+// 客户端配置
+struct ClientOptions {
+    std::string host = "127.0.0.1";
+    uint16_t port = 6667;
+    int max_connections = 4; // 连接池大小
+    int max_pipeline = 4;    // 每个连接上未完成的请求数上限
+};
+
+class Connection;
+
+struct Request;
+
+// 异步网盘客户端: 请求分配到连接池中最空闲的连接, 同一连接上的请求流水线发送
+// 每个操作都可以传入std::stop_token取消(request_stop需在事件循环线程中调用)
+class Client {
+public:
+    Client(EventLoop &loop, ClientOptions options);
+
+    ~Client();
+
+    Client(const Client &) = delete;
+
+    Client &operator=(const Client &) = delete;
+
+    // 递归查询目录(depth=1只查一层, 0不限制; filter为文件名通配符)
+    Task<Result<std::vector<Entry>>> list(const std::string &path, int depth = 1, const std::string &filter = "",
+                                          std::stop_token token = {});
+
+    // 下载文件到local_path(先写local_path.part, 完成后改名)
+    Task<Status> download(const std::string &remote_path, const std::string &local_path,
+                          std::stop_token token = {});
+
+    // 上传本地文件(checksum=true时服务端校验hash)
+    Task<Status> upload(const std::string &local_path, const std::string &remote_path, bool checksum = false,
+                        std::stop_token token = {});
+
+    // 服务端文件内容hash
+    Task<Result<uint64_t>> hash(const std::string &remote_path, std::stop_token token = {});
+
+    // 搜索服务端索引(mode为SEARCH_*, SEARCH_CHANGED时使用since)
+    // since之后的墓碑已被服务端清除时返回ESTALE, 需要用since=0完全重新同步
+    Task<Result<SearchResult>> search(int mode, const std::string &pattern, uint64_t since = 0,
+                                      std::stop_token token = {});
+
+    EventLoop &loop() { return loop_; }
+
+private:
+    friend class Connection;
+
+    friend struct RequestAwaiter;
+
+    // 请求进入等待队列并分配连接
+    void submit(const std::shared_ptr<Request> &request);
+
+    // 把等待队列中的请求分配到连接
+    void dispatch();
+
+    // 取消请求
+    void cancel(const std::shared_ptr<Request> &request);
+
+    // 连接断开后从连接池移除
+    void remove(Connection *connection);
+
+    // 服务端繁忙拒绝了连接: retry_after毫秒内连接池不超过仍存活的连接数, 不再立即重开被拒绝的连接
+    void busy(int retry_after);
+
+    EventLoop &loop_;
+    ClientOptions options_;
+    std::vector<std::unique_ptr<Connection>> connections_;
+    std::deque<std::shared_ptr<Request>> pending_; // 还没有分配连接的请求
+    int busy_limit_ = 0;                            // 繁忙期间的连接池大小(0表示不限制)
+    std::chrono::steady_clock::time_point busy_until_; // 繁忙期间的结束时间
+};
+
+}
+
+#endif //NETDISK_CLIENT_H
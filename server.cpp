@@ -1,29 +1,102 @@
 #include <cstdio>
+#include <cstdint>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
+#include <cerrno>
 #include <cstring>
 #include <pthread.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <csignal>
+#include <linux/tcp.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <string>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 
 #define MSG_TYPE_QUERY    1      // 查询
 #define MSG_TYPE_DOWNLOAD 2      // 下载
 #define MSG_TYPE_UPLOAD   3      // 上传
 #define MSG_TYPE_ERROR    4      // 错误
+#define MSG_TYPE_QUERY_TREE 5    // 递归查询(flag=最大深度, buffer=文件名过滤)
+
+#define MSG_TYPE_HASH     6      // 文件内容hash(回复的buffer=uint64_t)
+#define MSG_TYPE_SEARCH   7      // 搜索索引(flag=搜索方式, fname=模式)
+#define MSG_TYPE_UPLOAD_BULK 8   // 批量上传(buffer=UPLOAD_HEADER, 之后紧跟文件内容)
+#define MSG_TYPE_BUSY     9      // 服务端繁忙(flag=建议的重试间隔(毫秒), 之后服务端关闭连接)
+
+#define QUERY_TREE_FLAG_END 1    // 递归查询结束标志(服务端回复的flag)
+#define QUERY_TREE_FLAG_PACKED 2 // 递归查询结果打包(服务端回复的flag, 见TREE_PACKED_ENTRY)
+#define SEARCH_FLAG_END   1      // 搜索结束标志(服务端回复的flag, buffer=当前版本号)
+#define SEARCH_FLAG_PACKED 2     // 搜索结果打包(服务端回复的flag, 见SEARCH_PACKED_ENTRY)
+#define SEARCH_FLAG_RESYNC 3     // 变化查询的起点早于已清除的墓碑, 需要完全重新同步(服务端回复的flag, buffer=当前版本号, 之后没有结束标志)
+
+#define UPLOAD_FLAG_CHECKSUM 1   // 批量上传需要校验hash(请求的flag)
+
+#define SEARCH_PREFIX     0      // 路径前缀
+#define SEARCH_GLOB       1      // 路径通配符(fnmatch)
+#define SEARCH_SUBSTRING  2      // 路径子串
+#define SEARCH_CHANGED    3      // 版本号大于N的变化(buffer=uint64_t N, 包括已删除的)
 
 #define BUFFER_SIZE       1024   // buffer最大大小
 #define NAME_SIZE         FILENAME_MAX     // 文件名(路径)最大大小
+#define QUERY_TREE_BATCH  16     // 递归查询每批发送的信息数(每条信息打包多个条目)
+#define QUERY_TREE_THREADS 8     // 一次递归查询的最大线程数(发起查询的连接线程加上共享线程池中的帮手)
+#define SEARCH_BATCH      16     // 搜索每批发送的信息数(每条信息打包多个条目)
+#define HASH_BLOCK_SIZE   (64 * 1024) // 计算hash时每次读取的大小
+#define INDEX_FLUSH_INTERVAL 5   // 索引落盘的间隔(秒)
+#define INDEX_GENERATION_RESERVE 65536 // 每次预留的版本号数(预留的上限落盘后才使用)
+#define INDEX_TOMBSTONE_WINDOW (1ULL << 20) // 墓碑保留的版本号范围, 更早的墓碑被清除, 从更早开始的变化查询需要完全重新同步
+#define UPLOAD_BULK_CHUNK (1024 * 1024) // 批量上传每次splice/read的大小
+#define HASH_INIT         0xcbf29ce484222325ULL // FNV-1a初始值
+#define INDEX_MAGIC       "NDINDEX2" // 索引文件标识
+#define INDEX_MAGIC_V1    "NDINDEX1" // 旧格式的索引文件标识(文件头没有horizon)
+#define TRACE_MAGIC       "NDTRACE1" // 请求跟踪文件标识
+#define TRACE_RING_SIZE   4096   // 请求跟踪环形缓冲区的槽数(2的幂, 写满时丢弃记录)
+#define TRACE_DRAIN_INTERVAL 100 // 请求跟踪写线程空闲时的等待间隔(毫秒)
+#define TRACE_ARG_SIZE    32     // 跟踪记录中保留的请求buffer长度
+#define TRACE_NAME_SIZE   176    // 跟踪记录中保留的路径长度(过长时截断)
+#define LISTEN_BACKLOG    128    // listen的accept队列长度
+#define MAX_CONNECTIONS   256    // 同时服务的最大连接数, 超过时回复繁忙(每个连接一个线程, 加上递归查询线程池,
+                                 // 线程数最多约MAX_CONNECTIONS + QUERY_TREE_THREADS, 栈都是CONNECTION_STACK_SIZE)
+#define ACCEPT_QUEUE_SHED 64     // accept队列中等待的连接超过该值时回复繁忙(来不及处理)
+#define BUSY_RETRY_AFTER  200    // 繁忙时建议的重试间隔(毫秒, 负载越高越长)
+#define MAX_BULK_TRANSFERS 16    // 同时进行的上传/下载数, 超过时排队(元数据查询不排队)
+#define MAX_BULK_QUERIES  4      // 同时进行的整树递归查询/全索引搜索数, 超过时排队(只列一层和前缀搜索不排队)
+#define IDLE_TIMEOUT      60     // 两个请求之间的最长空闲时间(秒)
+#define MIN_THROUGHPUT    1024   // 处理请求时的最低吞吐量(字节/秒), 低于它视为慢客户端
+#define THROUGHPUT_WINDOW 10     // 检查吞吐量的时间窗口(秒)
+#define TIMER_WHEEL_SLOTS 64     // 超时检查时间轮的槽数(每槽1秒, 要大于IDLE_TIMEOUT)
+#define CONNECTION_STACK_SIZE (256 * 1024) // 连接线程的栈大小
 
 const char QUERY_PATH[] = "/home/draft/Clion/linux/server/"; // 查询路径(网盘根目录)
 const char DOWNLOAD_PATH[] = "/home/draft/Clion/linux/server/"; // 下载路径(网盘发送文件的路径)
 const char UPLOAD_PATH[] = "/home/draft/Clion/linux/server/"; // 上传路径(网盘保存文件的路径)
+const char INDEX_PATH[] = "/home/draft/Clion/linux/server.index"; // 文件索引路径(不能在网盘根目录中)
+const char SHARD_PATH[] = "/home/draft/Clion/linux/server.shards/"; // 分片存储的物理根目录(不能在网盘根目录中)
+const char SHARD_LOG_PATH[] = "/home/draft/Clion/linux/server.index.log"; // 分片存储的元数据日志(索引落盘后清空)
+const char TRACE_PATH[] = "/home/draft/Clion/linux/server.trace"; // 请求跟踪文件的默认路径("./server --trace [path]")
+
+// 分片存储: 文件按逻辑路径的hash存放在两级256路的子目录中, 目录结构只存在于索引(元数据)中
+// 打开前先停止服务端, 用"./server --migrate"把网盘根目录中已有的文件迁移过去
+const bool sharded_storage = false;
 
 /**
  * 1: Hint
@@ -96,7 +169,8 @@ typedef struct msg {
     // 用于输出信息
     std::string toString() {
         std::stringstream ss;
-        auto buffer_copy = buffer_to_string(buffer, bytes);
+        // 打包的结果在fname中, bytes是打包的长度, 可能超过buffer大小; 只输出buffer内的部分
+        auto buffer_copy = buffer_to_string(buffer, std::min<size_t>(std::max(bytes, 0), sizeof(buffer)));
         if (type == -1) {
             output_warn("get empty msg");
         }
@@ -122,20 +196,127 @@ typedef struct msg {
     }
 } MSG;
 
+// 递归查询结果中的文件信息(放在MSG的buffer中)
+typedef struct tree_entry {
+    int64_t size;  // 文件大小
+    int64_t mtime; // 修改时间(秒)
+} TREE_ENTRY;
+
+// 打包的递归查询结果(QUERY_TREE_FLAG_PACKED): 多个条目依次放在MSG的fname中, bytes为总长度
+// 每个条目是TREE_PACKED_ENTRY后紧跟路径(不含'\0'), 整体按8字节对齐
+typedef struct tree_packed_entry {
+    int64_t size;     // 文件大小
+    int64_t mtime;    // 修改时间(秒)
+    int32_t name_len; // 路径长度
+    int32_t reserved;
+} TREE_PACKED_ENTRY;
+
+// 索引中的文件信息
+typedef struct index_entry {
+    int64_t size;        // 文件大小
+    int64_t mtime;       // 修改时间(秒)
+    uint64_t hash;       // 文件内容hash(目录为0)
+    uint64_t generation; // 最后一次变化时的版本号
+    int32_t deleted;     // 已删除(只出现在变化查询中)
+    int32_t reserved;
+} INDEX_ENTRY;
+
+// 打包的搜索结果(SEARCH_FLAG_PACKED): 和递归查询一样放在MSG的fname中, bytes为总长度
+// 每个条目是SEARCH_PACKED_ENTRY后紧跟路径(不含'\0'), 整体按8字节对齐
+typedef struct search_packed_entry {
+    INDEX_ENTRY entry;
+    int32_t name_len; // 路径长度
+    int32_t reserved;
+} SEARCH_PACKED_ENTRY;
+
+// 批量上传的头部信息(放在MSG的buffer中)
+typedef struct upload_header {
+    int64_t length; // 文件内容长度
+    uint64_t hash;  // 文件内容hash(flag带UPLOAD_FLAG_CHECKSUM时校验)
+} UPLOAD_HEADER;
+
+// 请求跟踪文件头
+typedef struct trace_header {
+    char magic[8];        // TRACE_MAGIC
+    uint32_t record_size; // sizeof(TRACE_RECORD)
+    uint32_t reserved;
+    int64_t start_time;   // 开始跟踪的时间(unix时间, 微秒)
+} TRACE_HEADER;
+
+// 请求跟踪记录(固定大小; 不记录文件内容, 只记录大小和用于生成合成内容的种子)
+typedef struct trace_record {
+    int64_t time;                // 收到请求的时间(相对开始跟踪, 微秒)
+    int64_t duration;            // 服务端处理耗时(微秒)
+    int64_t size;                // 文件大小(上传/下载/hash, 文件不存在为-1), 其他请求为0
+    uint64_t seed;               // 合成文件内容的种子
+    uint32_t conn;               // 连接编号(同一连接上的请求按顺序处理)
+    int32_t type;                // 请求类型
+    int32_t flag;                // 请求的flag
+    int32_t bytes;               // 请求的bytes
+    char arg[TRACE_ARG_SIZE];    // 请求buffer的开头(递归查询的过滤, 变化查询的版本号), 上传时为空
+    char fname[TRACE_NAME_SIZE]; // 请求路径
+} TRACE_RECORD;
+
+// 分片存储(实现在文件索引之后)
+bool shard_list(const std::string &path, int max_depth, const std::string &filter,
+                std::vector<std::pair<std::string, INDEX_ENTRY>> &results);
+bool shard_normalize(const std::string &path, bool is_dir, std::string &logical);
+std::string shard_resolve(const std::string &path, INDEX_ENTRY *entry);
+std::string shard_tmp_path(const std::string &path);
+int shard_commit(const std::string &path, const std::string &tmp_path, const uint64_t *hash);
+
+// 文件索引中的hash(实现在文件索引中)
+bool index_cached_hash(const std::string &path, const struct stat &fileInfo, uint64_t &hash);
+
+// 超时检查(实现在准入控制中)
+void conn_set_receiving(bool receiving);
+
+// 循环读取直到读满n字节(TCP可能拆包), 返回值同read
+ssize_t read_all(int fd, void *buffer, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t res = read(fd, (char *) buffer + done, n - done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0) return done > 0 ? (ssize_t) done : -1;
+        if (res == 0) break;
+        done += res;
+    }
+    return (ssize_t) done;
+}
+
+// 循环写入直到写完n字节, 返回值同write
+ssize_t write_all(int fd, const void *buffer, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t res = write(fd, (const char *) buffer + done, n - done);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0) return -1;
+        done += res;
+    }
+    return (ssize_t) done;
+}
+
 // 向socket中写入(发送)信息，同时输出log
 ssize_t read_net_with_log(int socket, MSG *m, size_t n, const std::string &hint) {
-    ssize_t res = read(socket, m, n);
+    ssize_t res = read_all(socket, m, n);
     output_debug("server <= " + m->toString() + " (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
     return res;
 }
 
 // 从socket中读取(发送)信息，同时输出log
 ssize_t write_net_with_log(int socket, MSG *m, size_t n, const std::string &hint) {
-    ssize_t res = write(socket, m, n);
+    ssize_t res = write_all(socket, m, n);
     output_debug("server => " + m->toString() + " (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
     return res;
 }
 
+// 一次性发送多条信息(减少系统调用)，同时输出log(只输出条数)
+ssize_t write_net_batch_with_log(int socket, MSG *m, size_t count, const std::string &hint) {
+    ssize_t res = write_all(socket, m, count * sizeof(MSG));
+    output_debug("server => " + std::to_string(count) + " msgs (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
+    return res;
+}
+
 // 向socket中写入错误信息，同时输出log
 ssize_t write_net_error_with_log(int accept_socket, const std::string &error, const std::string &hint) {
     MSG tmp = MSG{MSG_TYPE_ERROR, 0};
@@ -146,8 +327,9 @@ ssize_t write_net_error_with_log(int accept_socket, const std::string &error, co
 // 从文件中读取信息，同时输出log
 ssize_t read_file_with_log(int fd, char *buffer, size_t n, const std::string &hint) {
     ssize_t res = read(fd, buffer, n);
+    // 读取失败时buffer中没有数据
     output_debug(
-            "file => " + buffer_to_string(buffer, res) + " (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
+            "file => " + buffer_to_string(buffer, res > 0 ? res : 0) + " (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
     return res;
 }
 
@@ -155,7 +337,7 @@ ssize_t read_file_with_log(int fd, char *buffer, size_t n, const std::string &hi
 ssize_t write_file_with_log(int fd, char *buffer, size_t n, const std::string &hint) {
     ssize_t res = write(fd, buffer, n);
     output_debug(
-            "file <= " + buffer_to_string(buffer, res) + " (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
+            "file <= " + buffer_to_string(buffer, res > 0 ? res : 0) + " (" + std::to_string(res) + " bytes)" + " (" + hint + ")");
     return res;
 }
 
@@ -184,7 +366,7 @@ int init_server_socket() {
             return 0;
         }
         // 监听端口
-        if (listen(server_socket, 10) < 0) {
+        if (listen(server_socket, LISTEN_BACKLOG) < 0) {
             output_error("fail to listen server");
             return 0;
         }
@@ -199,6 +381,28 @@ void func_query(int accept_socket, char *query_path_) {
     ssize_t res;
     std::string query_path = QUERY_PATH + std::string(query_path_);
 
+    // 分片存储: 从索引中列出直接子项
+    if (sharded_storage) {
+        std::vector<std::pair<std::string, INDEX_ENTRY>> results;
+        if (!shard_list(query_path_, 1, "", results)) {
+            output_error("fail to open dir!");
+            write_net_error_with_log(accept_socket, "dir no exist:" + std::string(query_path_), "send error to client");
+            return;
+        }
+        output_info("querying dir: " + std::string(query_path_) + " (sharded)");
+        for (auto &result: results) {
+            info_msg.clear();
+            info_msg.type = MSG_TYPE_QUERY;
+            strcpy(info_msg.fname, result.first.c_str());
+            if (write_net_with_log(accept_socket, &info_msg, sizeof(info_msg), "send path name") < 0) {
+                output_error("send menu error, unknown error!");
+                return;
+            }
+        }
+        output_info("queried dir: " + std::string(query_path_));
+        return;
+    }
+
     // 选择目录
     DIR *dp = opendir(query_path.c_str());
     if (nullptr == dp) {
@@ -239,8 +443,6 @@ void func_query(int accept_socket, char *query_path_) {
 
         // 发送
         res = write_net_with_log(accept_socket, &info_msg, sizeof(info_msg), "send path name");
-        // 延时防止客户端错乱
-        usleep(0.2 * 1000 * 1000);
 
         if (res < 0) {
             output_error("send menu error, unknown error!");
@@ -251,16 +453,386 @@ void func_query(int accept_socket, char *query_path_) {
     output_info("queried dir: " + query_path);
 }
 
+// 递归查询的目录任务
+struct tree_task {
+    std::string rel_path; // 相对于查询根目录的路径(以'/'结尾, 根目录为"")
+    int depth;            // 目录深度(根目录为0)
+};
+
+// 递归查询的工作位置(每个线程一个任务队列, 空闲时从其他线程的队列窃取任务)
+struct tree_worker {
+    struct tree_walk *walk;
+    int id;
+    pthread_mutex_t lock;
+    std::deque<tree_task> tasks;
+};
+
+// 递归查询的共享状态
+struct tree_walk {
+    int accept_socket;
+    int root_fd;                // 查询根目录, 子目录都用openat相对它打开
+    int max_depth;              // 最大深度(<=0表示不限制)
+    std::string filter;         // 文件名过滤(fnmatch模式, 空表示不过滤)
+    std::vector<tree_worker> workers; // 0号是发起查询的连接线程, 其余留给线程池中的帮手
+    int joined;                 // 已占用的工作位置数(tree_pool_lock保护)
+    int helpers;                // 正在参与遍历的帮手数(tree_pool_lock保护), 为0后才能销毁
+    std::atomic<long> pending;  // 未完成的目录任务数, 为0时遍历结束
+    std::atomic<long> sent;     // 已打包发送的条目数
+    std::atomic<bool> failed;   // 发送失败(客户端断开)
+    pthread_mutex_t send_lock;  // 保证一批信息连续写入socket
+    std::atomic<int> waiting;   // 阻塞等待任务的线程数
+    pthread_mutex_t idle_lock;  // 空闲线程在idle_cond上等待新任务或遍历结束
+    pthread_cond_t idle_cond;
+};
+
+// 唤醒等待任务的空闲线程(没有线程等待时不加锁)
+void tree_wake(tree_walk *walk, bool all) {
+    // 入队(或pending减到0)之后再读waiting, 和tree_wait中先加waiting再检查的顺序配对
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (walk->waiting == 0) return;
+    pthread_mutex_lock(&walk->idle_lock);
+    if (all) {
+        pthread_cond_broadcast(&walk->idle_cond);
+    } else {
+        pthread_cond_signal(&walk->idle_cond);
+    }
+    pthread_mutex_unlock(&walk->idle_lock);
+}
+
+// 把目录任务放入自己的队列
+void tree_push(tree_walk *walk, int id, tree_task task) {
+    tree_worker &self = walk->workers[id];
+    walk->pending++;
+    pthread_mutex_lock(&self.lock);
+    self.tasks.push_back(std::move(task));
+    pthread_mutex_unlock(&self.lock);
+    tree_wake(walk, false);
+}
+
+// 取出目录任务: 先从自己队列尾部取(深度优先, 局部性好), 再从其他队列头部窃取(广度大的任务)
+bool tree_pop(tree_walk *walk, int id, tree_task &task) {
+    int n = (int) walk->workers.size();
+    for (int i = 0; i < n; ++i) {
+        tree_worker &victim = walk->workers[(id + i) % n];
+        pthread_mutex_lock(&victim.lock);
+        if (!victim.tasks.empty()) {
+            if (i == 0) {
+                task = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+            } else {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+            }
+            pthread_mutex_unlock(&victim.lock);
+            return true;
+        }
+        pthread_mutex_unlock(&victim.lock);
+    }
+    return false;
+}
+
+// 是否有线程的队列中还有任务
+bool tree_has_task(tree_walk *walk) {
+    for (auto &worker: walk->workers) {
+        pthread_mutex_lock(&worker.lock);
+        bool empty = worker.tasks.empty();
+        pthread_mutex_unlock(&worker.lock);
+        if (!empty) return true;
+    }
+    return false;
+}
+
+// 暂时没有任务(其他线程还在扫描大目录): 阻塞到有新任务或遍历结束, 不空转
+void tree_wait(tree_walk *walk) {
+    pthread_mutex_lock(&walk->idle_lock);
+    walk->waiting++;
+    while (walk->pending > 0 && !walk->failed && !tree_has_task(walk)) {
+        pthread_cond_wait(&walk->idle_cond, &walk->idle_lock);
+    }
+    walk->waiting--;
+    pthread_mutex_unlock(&walk->idle_lock);
+}
+
+// 把一个条目打包进批次的最后一条信息, 放不下时开始新的信息; 批次已满时返回false(先发送再重试)
+bool tree_pack(std::vector<MSG> &batch, const std::string &rel_path, int64_t size, int64_t mtime) {
+    size_t length = (sizeof(TREE_PACKED_ENTRY) + rel_path.length() + 7) & ~(size_t) 7;
+    if (batch.empty() || batch.back().bytes + length > sizeof(batch.back().fname)) {
+        if (batch.size() >= QUERY_TREE_BATCH) return false;
+        batch.emplace_back();
+        MSG &info_msg = batch.back();
+        info_msg.clear();
+        info_msg.type = MSG_TYPE_QUERY_TREE;
+        info_msg.flag = QUERY_TREE_FLAG_PACKED;
+    }
+    MSG &info_msg = batch.back();
+    TREE_PACKED_ENTRY entry = {size, mtime, (int32_t) rel_path.length(), 0};
+    memcpy(info_msg.fname + info_msg.bytes, &entry, sizeof(entry));
+    memcpy(info_msg.fname + info_msg.bytes + sizeof(entry), rel_path.data(), rel_path.length());
+    info_msg.bytes += (int) length;
+    return true;
+}
+
+// 打包的条目放得下时路径的最大长度
+bool tree_name_fits(const std::string &rel_path) {
+    return sizeof(TREE_PACKED_ENTRY) + rel_path.length() <= sizeof(MSG::fname);
+}
+
+// 发送一批查询结果
+void tree_flush(tree_walk *walk, std::vector<MSG> &batch) {
+    if (batch.empty() || walk->failed) {
+        batch.clear();
+        return;
+    }
+    pthread_mutex_lock(&walk->send_lock);
+    ssize_t res = write_net_batch_with_log(walk->accept_socket, batch.data(), batch.size(), "send tree entries");
+    pthread_mutex_unlock(&walk->send_lock);
+    if (res < 0) {
+        output_error("send tree entries error");
+        walk->failed = true;
+        tree_wake(walk, true);
+    }
+    batch.clear();
+}
+
+// 扫描一个目录: 子目录作为新任务, 匹配的条目放入待发送批次
+void tree_scan_dir(tree_walk *walk, int id, const tree_task &task, std::vector<MSG> &batch) {
+    int dir_fd = task.rel_path.empty() ? dup(walk->root_fd)
+                                       : openat(walk->root_fd, task.rel_path.c_str(),
+                                                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd < 0) {
+        output_error("fail to open dir: " + task.rel_path);
+        return;
+    }
+    DIR *dp = fdopendir(dir_fd);
+    if (nullptr == dp) {
+        output_error("fail to open dir: " + task.rel_path);
+        close(dir_fd);
+        return;
+    }
+
+    struct dirent *dir;
+    struct stat fileInfo{};
+    while (nullptr != (dir = readdir(dp)) && !walk->failed) {
+        if (dir->d_name[0] == '.') continue;
+
+        // 相对当前目录获取文件信息, 不跟随符号链接(避免循环)
+        if (fstatat(dir_fd, dir->d_name, &fileInfo, AT_SYMLINK_NOFOLLOW) != 0) {
+            output_error("Failed to get file info." + task.rel_path + dir->d_name);
+            continue;
+        }
+        bool is_dir = S_ISDIR(fileInfo.st_mode);
+        std::string rel_path = task.rel_path + dir->d_name + (is_dir ? "/" : "");
+        if (!tree_name_fits(rel_path)) {
+            output_warn("path too long, skipped: " + rel_path);
+            continue;
+        }
+
+        if (is_dir && (walk->max_depth <= 0 || task.depth + 1 < walk->max_depth)) {
+            tree_push(walk, id, tree_task{rel_path, task.depth + 1});
+        }
+        if (!walk->filter.empty() && fnmatch(walk->filter.c_str(), dir->d_name, 0) != 0) continue;
+
+        if (!tree_pack(batch, rel_path, fileInfo.st_size, fileInfo.st_mtim.tv_sec)) {
+            tree_flush(walk, batch);
+            tree_pack(batch, rel_path, fileInfo.st_size, fileInfo.st_mtim.tv_sec);
+        }
+        walk->sent++;
+    }
+    closedir(dp);
+}
+
+// 递归查询工作循环(连接线程和线程池中的帮手都运行它)
+void *thread_tree_worker(void *arg) {
+    auto self = (tree_worker *) arg;
+    tree_walk *walk = self->walk;
+    std::vector<MSG> batch;
+    batch.reserve(QUERY_TREE_BATCH);
+    tree_task task;
+
+    while (walk->pending > 0 && !walk->failed) {
+        if (!tree_pop(walk, self->id, task)) {
+            // 暂时没有任务, 其他线程还在扫描; 等待前先发出已打包的条目
+            tree_flush(walk, batch);
+            tree_wait(walk);
+            continue;
+        }
+        tree_scan_dir(walk, self->id, task, batch);
+        // 子目录已先入队, 所以这里减到0时遍历一定结束
+        if (--walk->pending == 0) tree_wake(walk, true);
+    }
+    tree_flush(walk, batch);
+    return nullptr;
+}
+
+// 递归查询线程池: 所有连接共享, 启动时创建, 递归查询的线程总数不随连接数增长
+// 需要帮手的查询在队列中等待空闲线程加入, 线程都忙时查询只由连接线程自己完成
+pthread_mutex_t tree_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tree_pool_cond = PTHREAD_COND_INITIALIZER; // 有查询需要帮手
+pthread_cond_t tree_pool_done = PTHREAD_COND_INITIALIZER; // 有帮手离开查询
+std::deque<tree_walk *> tree_pool_walks; // 还有空余工作位置的查询
+int tree_pool_size = 0;                  // 线程池的线程数
+
+// 线程池中的帮手: 占用一个空余的工作位置参与遍历, 遍历结束后回到池中
+void *thread_tree_pool(void *) {
+    while (true) {
+        pthread_mutex_lock(&tree_pool_lock);
+        while (tree_pool_walks.empty()) pthread_cond_wait(&tree_pool_cond, &tree_pool_lock);
+        tree_walk *walk = tree_pool_walks.front();
+        int id = walk->joined++;
+        if (walk->joined == (int) walk->workers.size()) tree_pool_walks.pop_front();
+        walk->helpers++;
+        pthread_mutex_unlock(&tree_pool_lock);
+
+        thread_tree_worker(&walk->workers[id]);
+
+        pthread_mutex_lock(&tree_pool_lock);
+        if (--walk->helpers == 0) pthread_cond_broadcast(&tree_pool_done);
+        pthread_mutex_unlock(&tree_pool_lock);
+    }
+    return nullptr;
+}
+
+// 开启递归查询线程池(每个CPU一个线程, 连接线程自己占一个; 栈和连接线程一样小)
+void tree_pool_start() {
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = (int) std::max(1L, std::min(cpu_count, (long) QUERY_TREE_THREADS)) - 1;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, CONNECTION_STACK_SIZE);
+    for (pthread_t pthread_id; tree_pool_size < count; ++tree_pool_size) {
+        if (pthread_create(&pthread_id, &attr, thread_tree_pool, nullptr) != 0) {
+            output_error("fail to create thread");
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// 分片存储的递归查询(直接从索引中列出, 分批发送结果), 发送失败返回false
+bool tree_send_sharded(int accept_socket, MSG &receive_msg) {
+    std::string filter(receive_msg.buffer, strnlen(receive_msg.buffer, sizeof(receive_msg.buffer)));
+    std::vector<std::pair<std::string, INDEX_ENTRY>> results;
+    if (!shard_list(receive_msg.fname, receive_msg.flag, filter, results)) {
+        output_error("fail to open dir!");
+        write_net_error_with_log(accept_socket, "dir no exist:" + std::string(receive_msg.fname),
+                                 "send error to client");
+        return false;
+    }
+    std::vector<MSG> batch;
+    batch.reserve(QUERY_TREE_BATCH);
+    for (size_t i = 0; i <= results.size(); ++i) {
+        if (i < results.size() && !tree_name_fits(results[i].first)) {
+            output_warn("path too long, skipped: " + results[i].first);
+            continue;
+        }
+        // 批次已满或全部打包完时发送
+        if (i == results.size() ||
+            !tree_pack(batch, results[i].first, results[i].second.size, results[i].second.mtime)) {
+            if (!batch.empty() &&
+                write_net_batch_with_log(accept_socket, batch.data(), batch.size(), "send tree entries") < 0) {
+                output_error("send tree entries error");
+                return false;
+            }
+            batch.clear();
+            if (i < results.size()) tree_pack(batch, results[i].first, results[i].second.size, results[i].second.mtime);
+        }
+    }
+    output_info("queried tree: " + std::string(receive_msg.fname) + " (" + std::to_string(results.size()) +
+                " entries, sharded)");
+    return true;
+}
+
+// 递归查询函数(连接线程和线程池中的帮手并行遍历, 分批发送结果)
+void func_query_tree(int accept_socket, MSG &receive_msg) {
+    std::string query_path = QUERY_PATH + std::string(receive_msg.fname);
+    MSG end_msg = {0};
+    end_msg.clear();
+    end_msg.type = MSG_TYPE_QUERY_TREE;
+    end_msg.flag = QUERY_TREE_FLAG_END;
+
+    if (sharded_storage) {
+        if (tree_send_sharded(accept_socket, receive_msg)) {
+            write_net_with_log(accept_socket, &end_msg, sizeof(end_msg), "send tree end");
+        }
+        return;
+    }
+
+    // 打开查询根目录
+    int root_fd = open(query_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        output_error("fail to open dir!");
+        write_net_error_with_log(accept_socket, "dir no exist:" + query_path, "send error to client");
+        return;
+    }
+
+    // 开始查询
+    tree_walk walk;
+    walk.accept_socket = accept_socket;
+    walk.root_fd = root_fd;
+    walk.max_depth = receive_msg.flag;
+    walk.filter = std::string(receive_msg.buffer, strnlen(receive_msg.buffer, sizeof(receive_msg.buffer)));
+    walk.pending = 0;
+    walk.sent = 0;
+    walk.failed = false;
+    walk.waiting = 0;
+    pthread_mutex_init(&walk.send_lock, nullptr);
+    pthread_mutex_init(&walk.idle_lock, nullptr);
+    pthread_cond_init(&walk.idle_cond, nullptr);
+    // 只列一层时只有一个目录, 不需要帮手
+    int slots = walk.max_depth == 1 ? 1 : tree_pool_size + 1;
+    walk.workers = std::vector<tree_worker>(slots);
+    walk.joined = 1;
+    walk.helpers = 0;
+    for (int i = 0; i < slots; ++i) {
+        walk.workers[i].walk = &walk;
+        walk.workers[i].id = i;
+        pthread_mutex_init(&walk.workers[i].lock, nullptr);
+    }
+    output_info("querying tree: " + query_path + " (depth=" + std::to_string(walk.max_depth) +
+                ", filter=\"" + walk.filter + "\", threads<=" + std::to_string(slots) + ")");
+
+    tree_push(&walk, 0, tree_task{"", 0});
+    if (slots > 1) {
+        pthread_mutex_lock(&tree_pool_lock);
+        tree_pool_walks.push_back(&walk);
+        pthread_cond_broadcast(&tree_pool_cond);
+        pthread_mutex_unlock(&tree_pool_lock);
+    }
+    thread_tree_worker(&walk.workers[0]);
+    // 遍历已结束: 不再接受新帮手, 等已加入的帮手离开后才能销毁
+    if (slots > 1) {
+        pthread_mutex_lock(&tree_pool_lock);
+        auto it = std::find(tree_pool_walks.begin(), tree_pool_walks.end(), &walk);
+        if (it != tree_pool_walks.end()) tree_pool_walks.erase(it);
+        while (walk.helpers > 0) pthread_cond_wait(&tree_pool_done, &tree_pool_lock);
+        pthread_mutex_unlock(&tree_pool_lock);
+    }
+    for (auto &worker: walk.workers) pthread_mutex_destroy(&worker.lock);
+    pthread_mutex_destroy(&walk.send_lock);
+    pthread_mutex_destroy(&walk.idle_lock);
+    pthread_cond_destroy(&walk.idle_cond);
+    close(root_fd);
+
+    // 发送结束标志
+    if (!walk.failed) {
+        write_net_with_log(accept_socket, &end_msg, sizeof(end_msg), "send tree end");
+    }
+    output_info("queried tree: " + query_path + " (" + std::to_string(walk.sent) + " entries)");
+}
+
 // 下载函数
 void func_download(int accept_socket, char *download_path_) {
 
     int fd;
     MSG file_msg = {0};
-    std::string download_path = DOWNLOAD_PATH + std::string(download_path_);
+    std::string download_path = sharded_storage ? shard_resolve(download_path_, nullptr)
+                                                : DOWNLOAD_PATH + std::string(download_path_);
 
-    // 打开文件
-    fd = open(download_path.c_str(), O_RDONLY);
+    // 打开文件(分片存储中不存在时路径为空)
+    fd = download_path.empty() ? -1 : open(download_path.c_str(), O_RDONLY);
     if (fd < 0) {
+        if (download_path.empty()) download_path = download_path_;
         output_error("fail to open file: " + download_path);
         write_net_error_with_log(accept_socket, "file no exist:" + download_path, "send error to client");
         return;
@@ -271,6 +843,7 @@ void func_download(int accept_socket, char *download_path_) {
 
     // 循环发送
     ssize_t res;
+    long long sent_bytes = 0;
     for (file_msg.clear(), strcpy(file_msg.fname, download_path_),
                  res = read_file_with_log(fd, file_msg.buffer, sizeof(file_msg.buffer), "read file data");
          res >= 0;
@@ -279,24 +852,97 @@ void func_download(int accept_socket, char *download_path_) {
         file_msg.type = MSG_TYPE_DOWNLOAD;
         file_msg.bytes = (int) res;
         if (res == 0) {
+            // 客户端以bytes<BUFFER_SIZE判断结束: 文件为空或大小是BUFFER_SIZE的整数倍时补发一个空块
+            if (sent_bytes % BUFFER_SIZE == 0) {
+                write_net_with_log(accept_socket, &file_msg, sizeof(MSG), "send file end");
+            }
             break;
         }
-        res = write_net_with_log(accept_socket, &file_msg, sizeof(MSG), "send file data");
-        if (res < 0) {
+        sent_bytes += res;
+        if (write_net_with_log(accept_socket, &file_msg, sizeof(MSG), "send file data") < 0) {
             output_error("fail to send file data");
             break;
         }
     }
+    // 读取失败(如路径是目录)时回复错误, 客户端以此结束下载, 不会一直等待结束块
+    if (res < 0) {
+        int error = errno;
+        output_error("fail to read file: " + download_path);
+        close(fd);
+        write_net_error_with_log(accept_socket, "fail to read file:" + download_path + ": " + strerror(error),
+                                 "send error to client");
+        return;
+    }
+    close(fd);
     // 发送完成
     output_info("downloaded file:" + download_path);
 }
 
+// 用一段数据更新hash(64位FNV-1a)
+uint64_t hash_update(uint64_t hash, const char *buffer, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        hash = (hash ^ (uint8_t) buffer[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// 计算文件内容的hash
+int hash_file(int fd, uint64_t &hash) {
+    static thread_local char buffer[HASH_BLOCK_SIZE];
+    ssize_t res;
+    hash = HASH_INIT;
+    while ((res = read(fd, buffer, sizeof(buffer))) > 0) {
+        hash = hash_update(hash, buffer, res);
+    }
+    return res < 0 ? -1 : 0;
+}
+
+// hash查询函数
+void func_hash(int accept_socket, char *hash_path_) {
+    MSG hash_msg = {0};
+    uint64_t hash;
+    std::string hash_path = DOWNLOAD_PATH + std::string(hash_path_);
+
+    if (sharded_storage) {
+        // 分片存储: 上传时已经计算过hash, 直接从索引中取
+        INDEX_ENTRY entry;
+        if (shard_resolve(hash_path_, &entry).empty()) {
+            output_error("fail to hash file: " + std::string(hash_path_));
+            write_net_error_with_log(accept_socket, "file no exist:" + std::string(hash_path_),
+                                     "send error to client");
+            return;
+        }
+        hash = entry.hash;
+    } else {
+        // 索引中的hash仍然有效(大小和修改时间没变)时直接使用, 否则重新计算
+        int fd = open(hash_path.c_str(), O_RDONLY);
+        struct stat fileInfo{};
+        if (fd < 0 || fstat(fd, &fileInfo) != 0 ||
+            (!index_cached_hash(hash_path_, fileInfo, hash) && hash_file(fd, hash) < 0)) {
+            output_error("fail to hash file: " + hash_path);
+            write_net_error_with_log(accept_socket, "file no exist:" + hash_path, "send error to client");
+            if (fd >= 0) close(fd);
+            return;
+        }
+        close(fd);
+    }
+
+    hash_msg.clear();
+    hash_msg.type = MSG_TYPE_HASH;
+    strcpy(hash_msg.fname, hash_path_);
+    memcpy(hash_msg.buffer, &hash, sizeof(hash));
+    hash_msg.bytes = sizeof(hash);
+    write_net_with_log(accept_socket, &hash_msg, sizeof(MSG), "send file hash");
+}
+
 // 上传函数
-void func_upload(int &fd, MSG &receive_msg) {
+void func_upload(int &fd, std::string &upload_path, MSG &receive_msg) {
     ssize_t res;
-    std::string upload_path = UPLOAD_PATH + std::string(receive_msg.fname);
     if (fd == -1) {
-        fd = open(upload_path.c_str(), O_CREAT | O_WRONLY, 0666);
+        // 分片存储时先写临时文件(每次上传不同), 接收完成后再放入分片目录
+        upload_path = sharded_storage ? shard_tmp_path(receive_msg.fname)
+                                      : UPLOAD_PATH + std::string(receive_msg.fname);
+        fd = open(upload_path.c_str(), O_CREAT | O_WRONLY | (sharded_storage ? O_TRUNC : 0), 0666);
         // 开始接收(第一次接收)
         output_info("uploading file:" + upload_path);
     }
@@ -308,31 +954,1469 @@ void func_upload(int &fd, MSG &receive_msg) {
         output_info("collected all upload file");
         close(fd);
         fd = -1;
+        if (sharded_storage && shard_commit(receive_msg.fname, upload_path, nullptr) < 0) {
+            output_error("fail to save file:" + std::string(receive_msg.fname));
+            unlink(upload_path.c_str());
+            return;
+        }
         // 完成接收(最后一次接收)
         output_info("uploaded file:" + upload_path);
     }
 
 }
 
+// 丢弃socket中剩余的上传内容(出错时保持消息边界)
+void drain_net(int accept_socket, int64_t remaining) {
+    char buffer[BUFFER_SIZE];
+    while (remaining > 0) {
+        ssize_t res = read(accept_socket, buffer, std::min((int64_t) sizeof(buffer), remaining));
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return;
+        remaining -= res;
+    }
+}
+
+// 零拷贝接收: socket -> pipe -> 文件, 数据不经过用户空间
+// 返回从socket读出的字节数, written为写入文件的字节数(写文件失败时较小, 管道中的数据已丢弃)
+int64_t receive_splice(int accept_socket, int fd, int64_t length, int64_t &written) {
+    int pipe_fd[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) < 0) {
+        output_error("fail to create pipe");
+        return 0;
+    }
+    // 尽量增大管道, 减少splice次数
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, UPLOAD_BULK_CHUNK);
+
+    int64_t consumed = 0;
+    written = 0;
+    while (consumed < length) {
+        ssize_t in = splice(accept_socket, nullptr, pipe_fd[1], nullptr,
+                            std::min((int64_t) UPLOAD_BULK_CHUNK, length - consumed), SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in <= 0) break;
+        consumed += in;
+        while (in > 0) {
+            ssize_t out = splice(pipe_fd[0], nullptr, fd, nullptr, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                output_error("fail to write file");
+                close(pipe_fd[0]);
+                close(pipe_fd[1]);
+                return consumed;
+            }
+            in -= out;
+            written += out;
+        }
+    }
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    return consumed;
+}
+
+// 单次拷贝接收并计算hash(大块对齐缓冲区), 返回值和written同receive_splice
+int64_t receive_with_hash(int accept_socket, int fd, int64_t length, int64_t &written, uint64_t &hash) {
+    char *buffer = nullptr;
+    if (posix_memalign((void **) &buffer, 4096, UPLOAD_BULK_CHUNK) != 0) {
+        output_error("fail to alloc buffer");
+        return 0;
+    }
+    int64_t consumed = 0;
+    written = 0;
+    hash = HASH_INIT;
+    while (consumed < length) {
+        ssize_t res = read(accept_socket, buffer, std::min((int64_t) UPLOAD_BULK_CHUNK, length - consumed));
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) break;
+        consumed += res;
+        hash = hash_update(hash, buffer, res);
+        if (write_all(fd, buffer, res) < 0) {
+            output_error("fail to write file");
+            break;
+        }
+        written += res;
+    }
+    free(buffer);
+    return consumed;
+}
+
+std::atomic<uint64_t> upload_sequence{0}; // 上传临时文件的序号(同一路径的并发上传写不同的临时文件)
+
+// 批量上传函数: 头部之后紧跟文件内容, 先写临时文件, 完成后改名
+void func_upload_bulk(int accept_socket, MSG &receive_msg) {
+    UPLOAD_HEADER header;
+    memcpy(&header, receive_msg.buffer, sizeof(header));
+    std::string upload_path = UPLOAD_PATH + std::string(receive_msg.fname);
+    // 长度非法时无法确定后面还有多少内容, 只能回复错误
+    if (header.length < 0) {
+        output_warn("bad upload length: " + std::to_string(header.length));
+        write_net_error_with_log(accept_socket, "bad upload length:" + std::string(receive_msg.fname),
+                                 "send error to client");
+        return;
+    }
+    // 临时文件以'.'开头, 查询和索引都会跳过; 带序号, 同一路径的并发上传互不覆盖, 最后改名的生效
+    size_t slash = upload_path.rfind('/');
+    std::string tmp_path = upload_path.substr(0, slash + 1) + "." + upload_path.substr(slash + 1) + "." +
+                           std::to_string(++upload_sequence) + ".part";
+    if (sharded_storage) {
+        upload_path = receive_msg.fname;
+        tmp_path = shard_tmp_path(upload_path);
+    } else {
+        // 父目录不存在时逐级创建(和分片存储一致), 权限同普通目录
+        for (size_t pos = upload_path.find('/', strlen(UPLOAD_PATH)); pos != std::string::npos;
+             pos = upload_path.find('/', pos + 1)) {
+            mkdir(upload_path.substr(0, pos).c_str(), 0755);
+        }
+    }
+
+    // 接收内容期间在等客户端发送, 超时检查按吞吐量判断慢客户端
+    conn_set_receiving(true);
+    int fd = open(tmp_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        output_error("fail to open file: " + tmp_path);
+        drain_net(accept_socket, header.length);
+        conn_set_receiving(false);
+        write_net_error_with_log(accept_socket, "fail to open file:" + upload_path, "send error to client");
+        return;
+    }
+
+    // 开始接收
+    output_info("uploading file:" + upload_path + " (" + std::to_string(header.length) + " bytes" +
+                (receive_msg.flag & UPLOAD_FLAG_CHECKSUM ? ", checksum)" : ", splice)"));
+    int64_t received, written;
+    uint64_t hash = 0;
+    if (receive_msg.flag & UPLOAD_FLAG_CHECKSUM) {
+        received = receive_with_hash(accept_socket, fd, header.length, written, hash);
+    } else {
+        received = receive_splice(accept_socket, fd, header.length, written);
+    }
+    close(fd);
+    // 只丢弃还没从socket读出的部分, 保持消息边界(客户端断开时直接返回)
+    if (received < header.length) drain_net(accept_socket, header.length - received);
+    conn_set_receiving(false);
+
+    std::string error;
+    if (received < header.length || written < received) {
+        error = (written < received ? "fail to write file:" : "fail to receive file:") + upload_path;
+    } else if ((receive_msg.flag & UPLOAD_FLAG_CHECKSUM) && hash != header.hash) {
+        error = "checksum mismatch:" + upload_path;
+    } else if (sharded_storage ? shard_commit(upload_path, tmp_path,
+                                              receive_msg.flag & UPLOAD_FLAG_CHECKSUM ? &hash : nullptr) < 0
+                               : rename(tmp_path.c_str(), upload_path.c_str()) < 0) {
+        error = "fail to save file:" + upload_path;
+    }
+    if (!error.empty()) {
+        output_error(error);
+        unlink(tmp_path.c_str());
+        write_net_error_with_log(accept_socket, error, "send error to client");
+        return;
+    }
+
+    // 完成接收
+    MSG reply_msg = {0};
+    reply_msg.clear();
+    reply_msg.type = MSG_TYPE_UPLOAD_BULK;
+    strcpy(reply_msg.fname, receive_msg.fname);
+    write_net_with_log(accept_socket, &reply_msg, sizeof(MSG), "confirm upload");
+    output_info("uploaded file:" + upload_path);
+}
+
+// 索引文件头
+struct index_file_header {
+    char magic[8];         // INDEX_MAGIC
+    uint64_t generation;   // 落盘时的版本号
+    uint64_t count;        // 记录数
+    uint64_t names_size;   // 文件名区大小
+    uint64_t horizon;      // 已清除的墓碑的版本号上限(index_horizon), 旧格式没有这个字段
+};
+
+// 索引文件中的一条记录(按路径排序, 路径存放在记录之后的文件名区)
+struct index_file_record {
+    uint64_t name_offset;
+    uint32_t name_len;
+    uint32_t reserved;
+    INDEX_ENTRY entry;
+};
+
+// 文件索引(内存中, 按相对路径排序; 目录以'/'结尾; 删除的文件保留为墓碑供"变化查询"使用)
+std::map<std::string, INDEX_ENTRY> index_entries;
+pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+uint64_t index_generation = 0;   // 当前版本号, 每次变化加一
+uint64_t index_generation_limit = 0; // 已落盘的版本号上限, 重启后从这里继续, 不会重复使用崩溃前发出的版本号
+uint64_t index_horizon = 0;      // 版本号不超过它的墓碑可能已被清除, 从更早开始的变化查询会漏掉删除
+bool index_dirty = false;        // 有未落盘的变化
+int index_inotify_fd = -1;
+std::unordered_map<int, std::string> index_watch_dirs; // inotify watch -> 相对目录(只在索引线程中访问)
+int shard_log_fd = -1;           // 分片存储的元数据日志(索引落盘之后的变化)
+
+void shard_log_compact(off_t flushed_size);
+
+// 把版本号上限写入临时文件再改名(和索引放在一起), 失败返回-1
+int index_save_generation_limit(uint64_t limit) {
+    std::string path = std::string(INDEX_PATH) + ".generation";
+    std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+    bool ok = fd >= 0 && write_all(fd, &limit, sizeof(limit)) == sizeof(limit) && fsync(fd) == 0;
+    if (fd >= 0) ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        output_error("fail to write generation limit: " + path);
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    index_generation_limit = limit;
+    return 0;
+}
+
+// 分配一个新版本号, 需持有写锁; 用完已落盘的上限时先预留下一段
+uint64_t index_next_generation_locked() {
+    if (index_generation >= index_generation_limit) {
+        index_save_generation_limit(index_generation + INDEX_GENERATION_RESERVE);
+    }
+    return ++index_generation;
+}
+
+// 启动时跳过上次运行可能已经发出的版本号(索引快照只记录落盘时的版本号, 之后的变化会在重启后重新扫描出来)
+// 必须在加载索引和重放元数据日志之后调用
+void index_restore_generation() {
+    std::string path = std::string(INDEX_PATH) + ".generation";
+    uint64_t limit = 0;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read_all(fd, &limit, sizeof(limit)) != sizeof(limit)) limit = 0;
+        close(fd);
+    }
+    pthread_rwlock_wrlock(&index_lock);
+    index_generation = std::max(index_generation, limit);
+    index_generation_limit = index_generation;
+    pthread_rwlock_unlock(&index_lock);
+    output_info("generation resumes after " + std::to_string(index_generation));
+}
+
+// 更新一条索引(有变化时才增加版本号), 需持有写锁
+void index_put_locked(const std::string &path, INDEX_ENTRY entry) {
+    auto it = index_entries.find(path);
+    if (it != index_entries.end() && !it->second.deleted && it->second.size == entry.size &&
+        it->second.mtime == entry.mtime && it->second.hash == entry.hash) {
+        return;
+    }
+    entry.generation = index_next_generation_locked();
+    index_entries[path] = entry;
+    index_dirty = true;
+}
+
+// 把一条索引及其子项标记为删除, 需持有写锁
+void index_remove_locked(const std::string &path) {
+    for (auto it = index_entries.lower_bound(path);
+         it != index_entries.end() && it->first.compare(0, path.length(), path) == 0; ++it) {
+        // 只删除自身和(目录的)子项, 不删除同前缀的兄弟项
+        if (it->first.length() != path.length() && *--path.end() != '/') continue;
+        if (it->second.deleted) continue;
+        it->second.deleted = 1;
+        it->second.generation = index_next_generation_locked();
+        index_dirty = true;
+    }
+}
+
+// 清除超出保留范围(INDEX_TOMBSTONE_WINDOW)的墓碑并推进horizon, 需持有写锁
+// horizon和清除后的索引一起落盘, 崩溃时磁盘上仍是清除前的索引和旧的horizon
+void index_compact_locked() {
+    if (index_generation <= INDEX_TOMBSTONE_WINDOW) return;
+    uint64_t horizon = index_generation - INDEX_TOMBSTONE_WINDOW;
+    size_t purged = 0;
+    for (auto it = index_entries.begin(); it != index_entries.end();) {
+        if (it->second.deleted && it->second.generation <= horizon) {
+            it = index_entries.erase(it);
+            purged++;
+        } else {
+            ++it;
+        }
+    }
+    if (purged == 0) return;
+    index_horizon = std::max(index_horizon, horizon);
+    index_dirty = true;
+    output_info("purged " + std::to_string(purged) + " tombstones (horizon=" + std::to_string(index_horizon) + ")");
+}
+
+// 从磁盘加载索引(mmap), 失败返回-1
+int index_load() {
+    int fd = open(INDEX_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat fileInfo{};
+    if (fstat(fd, &fileInfo) != 0 || fileInfo.st_size < (off_t) sizeof(index_file_header) - (off_t) sizeof(uint64_t)) {
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(nullptr, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    // 旧格式的文件头少了horizon(没有清除过墓碑)
+    auto header = (const index_file_header *) data;
+    bool v1 = memcmp(header->magic, INDEX_MAGIC_V1, sizeof(header->magic)) == 0;
+    size_t header_size = v1 ? offsetof(index_file_header, horizon) : sizeof(index_file_header);
+    auto records = (const index_file_record *) ((const char *) data + header_size);
+    auto names = (const char *) (records + header->count);
+    bool valid = (v1 || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0) &&
+                 (uint64_t) fileInfo.st_size >= header_size &&
+                 header_size + header->count * sizeof(index_file_record) + header->names_size ==
+                 (uint64_t) fileInfo.st_size;
+    if (valid) {
+        pthread_rwlock_wrlock(&index_lock);
+        for (uint64_t i = 0; i < header->count; ++i) {
+            if (records[i].name_offset + records[i].name_len > header->names_size) {
+                valid = false;
+                break;
+            }
+            // 记录已排序, 从末尾插入
+            index_entries.emplace_hint(index_entries.end(),
+                                       std::string(names + records[i].name_offset, records[i].name_len),
+                                       records[i].entry);
+        }
+        index_generation = header->generation;
+        index_horizon = v1 ? 0 : header->horizon;
+        if (!valid) index_entries.clear();
+        pthread_rwlock_unlock(&index_lock);
+    }
+    munmap(data, fileInfo.st_size);
+    return valid ? 0 : -1;
+}
+
+// 把索引写入临时文件再改名, 保证磁盘上的索引总是完整的
+int index_flush() {
+    std::string tmp_path = std::string(INDEX_PATH) + ".tmp";
+    FILE *fp = fopen(tmp_path.c_str(), "wb");
+    if (nullptr == fp) {
+        output_error("fail to open index: " + tmp_path);
+        return -1;
+    }
+
+    // 修改索引都持有写锁, 这里持有读锁即可
+    pthread_rwlock_rdlock(&index_lock);
+    off_t log_size = shard_log_fd >= 0 ? lseek(shard_log_fd, 0, SEEK_END) : 0;
+    index_file_header header = {{0}, index_generation, index_entries.size(), 0, index_horizon};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    for (auto &item: index_entries) header.names_size += item.first.length();
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    uint64_t name_offset = 0;
+    for (auto it = index_entries.begin(); ok && it != index_entries.end(); ++it) {
+        index_file_record record = {name_offset, (uint32_t) it->first.length(), 0, it->second};
+        name_offset += it->first.length();
+        ok = fwrite(&record, sizeof(record), 1, fp) == 1;
+    }
+    for (auto it = index_entries.begin(); ok && it != index_entries.end(); ++it) {
+        ok = fwrite(it->first.data(), 1, it->first.length(), fp) == it->first.length();
+    }
+    index_dirty = false;
+    pthread_rwlock_unlock(&index_lock);
+
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), INDEX_PATH) < 0) {
+        output_error("fail to write index: " + tmp_path);
+        unlink(tmp_path.c_str());
+        index_dirty = true;
+        return -1;
+    }
+    // 已落盘的元数据日志不再需要
+    if (shard_log_fd >= 0) shard_log_compact(log_size);
+    output_info("flushed index (generation=" + std::to_string(header.generation) +
+                ", entries=" + std::to_string(header.count) + ")");
+    return 0;
+}
+
+// 查找索引中文件的hash, 文件的大小和修改时间与索引一致时才算命中(和index_update_file的判断相同)
+bool index_cached_hash(const std::string &path, const struct stat &fileInfo, uint64_t &hash) {
+    std::string rel_path;
+    if (!S_ISREG(fileInfo.st_mode) || !shard_normalize(path, false, rel_path)) return false;
+    pthread_rwlock_rdlock(&index_lock);
+    auto it = index_entries.find(rel_path);
+    bool hit = it != index_entries.end() && !it->second.deleted && it->second.size == fileInfo.st_size &&
+               it->second.mtime == fileInfo.st_mtim.tv_sec;
+    if (hit) hash = it->second.hash;
+    pthread_rwlock_unlock(&index_lock);
+    return hit;
+}
+
+// 根据文件当前状态更新索引(大小或修改时间变化才重新计算hash)
+void index_update_file(int dir_fd, const std::string &rel_path, const char *name) {
+    struct stat fileInfo{};
+    if (fstatat(dir_fd, name, &fileInfo, AT_SYMLINK_NOFOLLOW) != 0) {
+        pthread_rwlock_wrlock(&index_lock);
+        index_remove_locked(rel_path);
+        pthread_rwlock_unlock(&index_lock);
+        return;
+    }
+    INDEX_ENTRY entry = {fileInfo.st_size, fileInfo.st_mtim.tv_sec, 0, 0, 0, 0};
+
+    pthread_rwlock_rdlock(&index_lock);
+    auto it = index_entries.find(rel_path);
+    bool unchanged = it != index_entries.end() && !it->second.deleted &&
+                     it->second.size == entry.size && it->second.mtime == entry.mtime;
+    if (unchanged) entry.hash = it->second.hash;
+    pthread_rwlock_unlock(&index_lock);
+    if (unchanged) return;
+
+    if (S_ISREG(fileInfo.st_mode)) {
+        int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || hash_file(fd, entry.hash) < 0) {
+            output_error("fail to hash file: " + rel_path);
+        }
+        if (fd >= 0) close(fd);
+    }
+    pthread_rwlock_wrlock(&index_lock);
+    index_put_locked(rel_path, entry);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// 扫描目录并加入inotify监听: 新增/变化的项更新索引, 不存在的项标记删除
+void index_scan_dir(const std::string &rel_dir) {
+    std::string dir_path = QUERY_PATH + rel_dir;
+    // 没有inotify时(迁移)只扫描
+    if (index_inotify_fd >= 0) {
+        int wd = inotify_add_watch(index_inotify_fd, dir_path.c_str(),
+                                   IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+                                   IN_ONLYDIR | IN_DONT_FOLLOW);
+        if (wd < 0) {
+            output_error("fail to watch dir: " + dir_path);
+        } else {
+            index_watch_dirs[wd] = rel_dir;
+        }
+    }
+
+    DIR *dp = opendir(dir_path.c_str());
+    if (nullptr == dp) {
+        output_error("fail to open dir: " + dir_path);
+        return;
+    }
+    std::vector<std::string> seen, sub_dirs;
+    struct dirent *dir;
+    while (nullptr != (dir = readdir(dp))) {
+        if (dir->d_name[0] == '.') continue;
+        struct stat fileInfo{};
+        if (fstatat(dirfd(dp), dir->d_name, &fileInfo, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (S_ISDIR(fileInfo.st_mode)) {
+            std::string rel_path = rel_dir + dir->d_name + "/";
+            pthread_rwlock_wrlock(&index_lock);
+            index_put_locked(rel_path, INDEX_ENTRY{fileInfo.st_size, fileInfo.st_mtim.tv_sec, 0, 0, 0, 0});
+            pthread_rwlock_unlock(&index_lock);
+            seen.push_back(rel_path);
+            sub_dirs.push_back(rel_path);
+        } else {
+            std::string rel_path = rel_dir + dir->d_name;
+            index_update_file(dirfd(dp), rel_path, dir->d_name);
+            seen.push_back(rel_path);
+        }
+    }
+    closedir(dp);
+
+    // 目录中已不存在的直接子项标记删除
+    std::sort(seen.begin(), seen.end());
+    std::vector<std::string> gone;
+    pthread_rwlock_rdlock(&index_lock);
+    for (auto it = index_entries.lower_bound(rel_dir);
+         it != index_entries.end() && it->first.compare(0, rel_dir.length(), rel_dir) == 0; ++it) {
+        size_t slash = it->first.find('/', rel_dir.length());
+        bool direct_child = it->first.length() > rel_dir.length() &&
+                            (slash == std::string::npos || slash == it->first.length() - 1);
+        if (direct_child && !it->second.deleted && !std::binary_search(seen.begin(), seen.end(), it->first)) {
+            gone.push_back(it->first);
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    pthread_rwlock_wrlock(&index_lock);
+    for (auto &path: gone) index_remove_locked(path);
+    pthread_rwlock_unlock(&index_lock);
+
+    for (auto &sub_dir: sub_dirs) index_scan_dir(sub_dir);
+}
+
+// 取消某个目录及其子目录的监听(目录被移走时)
+void index_unwatch_dir(const std::string &rel_dir) {
+    for (auto it = index_watch_dirs.begin(); it != index_watch_dirs.end();) {
+        if (it->second.compare(0, rel_dir.length(), rel_dir) == 0) {
+            inotify_rm_watch(index_inotify_fd, it->first);
+            it = index_watch_dirs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// 处理一个inotify事件
+void index_handle_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        output_warn("inotify queue overflow, rescanning index");
+        index_scan_dir("");
+        return;
+    }
+    auto watch = index_watch_dirs.find(event->wd);
+    if (watch == index_watch_dirs.end()) return;
+    if (event->mask & IN_IGNORED) {
+        index_watch_dirs.erase(watch);
+        return;
+    }
+    if (event->len == 0 || event->name[0] == '.') return;
+
+    std::string rel_dir = watch->second;
+    std::string rel_path = rel_dir + event->name;
+    if (event->mask & IN_ISDIR) {
+        rel_path += '/';
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            index_unwatch_dir(rel_path);
+            pthread_rwlock_wrlock(&index_lock);
+            index_remove_locked(rel_path);
+            pthread_rwlock_unlock(&index_lock);
+        } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            struct stat fileInfo{};
+            if (stat((QUERY_PATH + rel_path).c_str(), &fileInfo) != 0) return;
+            pthread_rwlock_wrlock(&index_lock);
+            index_put_locked(rel_path, INDEX_ENTRY{fileInfo.st_size, fileInfo.st_mtim.tv_sec, 0, 0, 0, 0});
+            pthread_rwlock_unlock(&index_lock);
+            // 监听建立前目录中可能已有文件, 扫描整个新目录
+            index_scan_dir(rel_path);
+        }
+        return;
+    }
+    int dir_fd = open((QUERY_PATH + rel_dir).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return;
+    index_update_file(dir_fd, rel_path, event->name);
+    close(dir_fd);
+}
+
+// 索引线程: 先对照磁盘校正已加载的索引, 然后由inotify增量更新, 定期落盘
+// 分片存储时索引就是元数据, 由上传直接更新, 这里只定期落盘
+void *thread_index(void *arg) {
+    if (!sharded_storage) {
+        output_info("index reconciling: " + std::string(QUERY_PATH));
+        index_scan_dir("");
+        output_info("index ready (generation=" + std::to_string(index_generation) + ")");
+    }
+    if (index_dirty) index_flush();
+
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    time_t last_flush = time(nullptr);
+    struct pollfd pfd = {index_inotify_fd, POLLIN, 0};
+    while (true) {
+        if (sharded_storage) {
+            sleep(INDEX_FLUSH_INTERVAL);
+        } else if (poll(&pfd, 1, INDEX_FLUSH_INTERVAL * 1000) > 0) {
+            ssize_t res = read(index_inotify_fd, buffer, sizeof(buffer));
+            for (ssize_t pos = 0; pos < res;) {
+                auto event = (const struct inotify_event *) (buffer + pos);
+                index_handle_event(event);
+                pos += (ssize_t) sizeof(struct inotify_event) + event->len;
+            }
+        }
+        if (index_dirty && time(nullptr) - last_flush >= INDEX_FLUSH_INTERVAL) {
+            pthread_rwlock_wrlock(&index_lock);
+            index_compact_locked();
+            pthread_rwlock_unlock(&index_lock);
+            index_flush();
+            last_flush = time(nullptr);
+        }
+    }
+    return nullptr;
+}
+
+// 分片存储的元数据日志中的一条记录(路径紧跟在记录之后)
+struct shard_log_record {
+    uint32_t name_len;
+    uint32_t reserved;
+    INDEX_ENTRY entry;
+};
+
+std::unordered_set<uint64_t> shard_keys; // 已使用的分片key(检查hash冲突), 需持有索引锁
+
+// 规范化逻辑路径: 去掉多余的'/'和"./", 目录以'/'结尾(根目录为""), 不允许".."
+bool shard_normalize(const std::string &path, bool is_dir, std::string &logical) {
+    logical.clear();
+    for (size_t begin = 0; begin <= path.length();) {
+        size_t end = std::min(path.find('/', begin), path.length());
+        std::string part = path.substr(begin, end - begin);
+        begin = end + 1;
+        if (part.empty() || part == ".") continue;
+        if (part == "..") return false;
+        logical += part + '/';
+    }
+    if (!is_dir) {
+        if (logical.empty() || path.back() == '/') return false;
+        logical.pop_back();
+    }
+    return logical.length() < NAME_SIZE;
+}
+
+// 逻辑路径的分片key
+uint64_t shard_key(const std::string &logical) {
+    return hash_update(HASH_INIT, logical.data(), logical.length());
+}
+
+// 分片key对应的物理路径: SHARD_PATH/xx/yy/key(两级各256个子目录, 取key的高16位)
+std::string shard_physical_path(uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%02x/%02x/%016llx", (unsigned) (key >> 56), (unsigned) (key >> 48) & 0xff,
+             (unsigned long long) key);
+    return SHARD_PATH + std::string(name);
+}
+
+// 按需创建物理路径的两级子目录
+void shard_make_dirs(const std::string &physical) {
+    std::string dir = physical.substr(0, physical.rfind('/'));
+    if (mkdir(dir.c_str(), S_IRWXU) < 0 && errno == ENOENT) {
+        mkdir(dir.substr(0, dir.rfind('/')).c_str(), S_IRWXU);
+        mkdir(dir.c_str(), S_IRWXU);
+    }
+}
+
+// 上传用的临时文件(和分片目录在同一文件系统中, 完成后改名)
+std::string shard_tmp_path(const std::string &path) {
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx.%llu.part", (unsigned long long) shard_key(path),
+             (unsigned long long) ++upload_sequence);
+    return SHARD_PATH + std::string("tmp/") + name;
+}
+
+// 查找逻辑路径对应的物理文件, 不存在时返回空串
+std::string shard_resolve(const std::string &path, INDEX_ENTRY *entry) {
+    std::string logical;
+    if (!shard_normalize(path, false, logical)) return "";
+    pthread_rwlock_rdlock(&index_lock);
+    auto it = index_entries.find(logical);
+    bool found = it != index_entries.end() && !it->second.deleted;
+    if (found && entry != nullptr) *entry = it->second;
+    pthread_rwlock_unlock(&index_lock);
+    return found ? shard_physical_path(shard_key(logical)) : "";
+}
+
+// 从索引中列出目录下的项(路径相对于该目录, 深度<=0表示不限制, 过滤只匹配文件名), 目录不存在返回false
+bool shard_list(const std::string &path, int max_depth, const std::string &filter,
+                std::vector<std::pair<std::string, INDEX_ENTRY>> &results) {
+    std::string dir;
+    if (!shard_normalize(path, true, dir)) return false;
+
+    pthread_rwlock_rdlock(&index_lock);
+    auto it = index_entries.find(dir);
+    if (!dir.empty() && (it == index_entries.end() || it->second.deleted)) {
+        pthread_rwlock_unlock(&index_lock);
+        return false;
+    }
+    for (it = index_entries.upper_bound(dir);
+         it != index_entries.end() && it->first.compare(0, dir.length(), dir) == 0;) {
+        const std::string &key = it->first;
+        bool is_dir = key.back() == '/';
+        int depth = (int) std::count(key.begin() + (long) dir.length(), key.end() - 1, '/') + 1;
+        if (!it->second.deleted && (max_depth <= 0 || depth <= max_depth)) {
+            size_t name_begin = key.rfind('/', key.length() - 2) + 1;
+            std::string name = key.substr(name_begin, key.length() - name_begin - is_dir);
+            if (filter.empty() || fnmatch(filter.c_str(), name.c_str(), 0) == 0) {
+                results.emplace_back(key.substr(dir.length()), it->second);
+            }
+        }
+        // 已删除或达到最大深度的目录跳过整个子树('0'是'/'的下一个字符)
+        if (is_dir && (it->second.deleted || (max_depth > 0 && depth >= max_depth))) {
+            it = index_entries.lower_bound(key.substr(0, key.length() - 1) + '0');
+        } else {
+            ++it;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return true;
+}
+
+// 追加一条元数据日志, 需持有写锁
+void shard_log_locked(const std::string &path, const INDEX_ENTRY &entry) {
+    shard_log_record record = {(uint32_t) path.length(), 0, entry};
+    std::string data((const char *) &record, sizeof(record));
+    data += path;
+    if (write_all(shard_log_fd, data.data(), data.size()) < 0) {
+        output_error("fail to write metadata log: " + path);
+    }
+}
+
+// 更新一条元数据并写日志, 需持有写锁
+void shard_put_locked(const std::string &path, const INDEX_ENTRY &entry) {
+    index_put_locked(path, entry);
+    shard_log_locked(path, index_entries[path]);
+}
+
+// 把接收完成的临时文件放入分片目录并更新元数据(没有hash时读取临时文件计算), 失败返回-1
+int shard_commit(const std::string &path, const std::string &tmp_path, const uint64_t *hash) {
+    std::string logical;
+    if (!shard_normalize(path, false, logical)) {
+        output_error("invalid path: " + path);
+        return -1;
+    }
+    struct stat fileInfo{};
+    INDEX_ENTRY entry = {0, 0, 0, 0, 0, 0};
+    int fd = open(tmp_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &fileInfo) != 0 || (hash == nullptr && hash_file(fd, entry.hash) < 0)) {
+        output_error("fail to hash file: " + tmp_path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    entry.size = fileInfo.st_size;
+    entry.mtime = fileInfo.st_mtim.tv_sec;
+    if (hash != nullptr) entry.hash = *hash;
+
+    uint64_t key = shard_key(logical);
+    std::string physical = shard_physical_path(key);
+    shard_make_dirs(physical);
+
+    // 检查冲突: 同名目录, 父路径是文件, 不同路径的key相同
+    pthread_rwlock_wrlock(&index_lock);
+    std::string error;
+    auto live = [](const std::string &p) {
+        auto it = index_entries.find(p);
+        return it != index_entries.end() && !it->second.deleted;
+    };
+    if (live(logical + "/")) error = "is a dir: " + logical;
+    for (size_t slash = logical.find('/'); error.empty() && slash != std::string::npos;
+         slash = logical.find('/', slash + 1)) {
+        if (live(logical.substr(0, slash))) error = "parent is a file: " + logical;
+    }
+    if (error.empty() && !live(logical) && shard_keys.count(key)) error = "shard key collision: " + logical;
+    if (error.empty() && rename(tmp_path.c_str(), physical.c_str()) < 0) error = "fail to save file: " + physical;
+    if (!error.empty()) {
+        pthread_rwlock_unlock(&index_lock);
+        output_error(error);
+        return -1;
+    }
+
+    // 父目录只存在于元数据中
+    for (size_t slash = logical.find('/'); slash != std::string::npos; slash = logical.find('/', slash + 1)) {
+        std::string parent = logical.substr(0, slash + 1);
+        if (!live(parent)) shard_put_locked(parent, INDEX_ENTRY{0, entry.mtime, 0, 0, 0, 0});
+    }
+    shard_put_locked(logical, entry);
+    shard_keys.insert(key);
+    pthread_rwlock_unlock(&index_lock);
+    return 0;
+}
+
+// 索引落盘后清理元数据日志: 只保留落盘期间新追加的记录
+void shard_log_compact(off_t flushed_size) {
+    pthread_rwlock_wrlock(&index_lock);
+    off_t size = lseek(shard_log_fd, 0, SEEK_END);
+    if (size == flushed_size) {
+        if (ftruncate(shard_log_fd, 0) < 0) output_error("fail to truncate metadata log");
+    } else {
+        std::string tail(size - flushed_size, '\0');
+        std::string tmp_path = std::string(SHARD_LOG_PATH) + ".tmp";
+        int fd = open(tmp_path.c_str(), O_CREAT | O_RDWR | O_TRUNC | O_APPEND | O_CLOEXEC, 0666);
+        if (fd < 0 || pread(shard_log_fd, tail.data(), tail.size(), flushed_size) != (ssize_t) tail.size() ||
+            write_all(fd, tail.data(), tail.size()) < 0 || rename(tmp_path.c_str(), SHARD_LOG_PATH) < 0) {
+            output_error("fail to compact metadata log");
+            if (fd >= 0) close(fd);
+            unlink(tmp_path.c_str());
+        } else {
+            close(shard_log_fd);
+            shard_log_fd = fd;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// 重放元数据日志(只应用比已加载的索引新的记录, 末尾不完整的记录忽略)
+void shard_replay() {
+    struct stat fileInfo{};
+    if (fstat(shard_log_fd, &fileInfo) != 0 || fileInfo.st_size == 0) return;
+    std::string data(fileInfo.st_size, '\0');
+    ssize_t res = pread(shard_log_fd, data.data(), data.size(), 0);
+    if (res < 0) {
+        output_error("fail to read metadata log: " + std::string(SHARD_LOG_PATH));
+        return;
+    }
+    data.resize(res);
+
+    pthread_rwlock_wrlock(&index_lock);
+    uint64_t loaded = index_generation;
+    size_t count = 0;
+    for (size_t pos = 0; pos + sizeof(shard_log_record) <= data.size();) {
+        shard_log_record record;
+        memcpy(&record, data.data() + pos, sizeof(record));
+        pos += sizeof(record);
+        if (pos + record.name_len > data.size()) break;
+        if (record.entry.generation > loaded) {
+            index_entries[data.substr(pos, record.name_len)] = record.entry;
+            index_generation = std::max(index_generation, record.entry.generation);
+            index_dirty = true;
+            count++;
+        }
+        pos += record.name_len;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    output_info("replayed metadata log: " + std::to_string(count) + " records (generation=" +
+                std::to_string(index_generation) + ")");
+}
+
+// 启动分片存储: 打开并重放元数据日志, 记录已使用的分片key
+int shard_start() {
+    std::string tmp_dir = SHARD_PATH + std::string("tmp");
+    if ((mkdir(SHARD_PATH, S_IRWXU) < 0 && errno != EEXIST) || (mkdir(tmp_dir.c_str(), S_IRWXU) < 0 && errno != EEXIST)) {
+        output_error("fail to make dir: " + tmp_dir);
+        return -1;
+    }
+    shard_log_fd = open(SHARD_LOG_PATH, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, 0666);
+    if (shard_log_fd < 0) {
+        output_error("fail to open metadata log: " + std::string(SHARD_LOG_PATH));
+        return -1;
+    }
+    shard_replay();
+
+    pthread_rwlock_wrlock(&index_lock);
+    for (auto &item: index_entries) {
+        if (!item.second.deleted && item.first.back() != '/') shard_keys.insert(shard_key(item.first));
+    }
+    pthread_rwlock_unlock(&index_lock);
+    output_info("sharded storage ready: " + std::string(SHARD_PATH) + " (" + std::to_string(shard_keys.size()) +
+                " files)");
+    return 0;
+}
+
+// 复制文件: 优先copy_file_range(支持的文件系统上是写时复制的reflink), 不支持时(如跨文件系统)用sendfile
+int shard_copy_file(const std::string &src, const std::string &dst) {
+    int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    int out = open(dst.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+    struct stat fileInfo{};
+    bool ok = in >= 0 && out >= 0 && fstat(in, &fileInfo) == 0;
+    bool use_range = true;
+    for (off_t done = 0; ok && done < fileInfo.st_size;) {
+        ssize_t res;
+        if (use_range) {
+            off_t out_offset = done;
+            res = copy_file_range(in, &done, out, &out_offset, fileInfo.st_size - done, 0);
+            if (res < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) &&
+                done == 0) {
+                use_range = false;
+                continue;
+            }
+        } else {
+            res = sendfile(out, in, &done, fileInfo.st_size - done);
+        }
+        if (res < 0 && errno == EINTR) continue;
+        ok = res > 0;
+    }
+    if (in >= 0) close(in);
+    if (out >= 0 && close(out) != 0) ok = false;
+    return ok ? 0 : -1;
+}
+
+// 迁移: 把网盘根目录中已有的文件复制到分片目录(原文件保留), 并写入元数据
+// 不用硬链接: 共享inode时原文件之后的修改会悄悄改变分片中的内容, 元数据中的大小和hash随之失效
+int shard_migrate() {
+    if (sharded_storage) {
+        output_error("migrate from the plain tree with sharded_storage = false");
+        return -1;
+    }
+    output_info("migrating: " + std::string(QUERY_PATH) + " -> " + std::string(SHARD_PATH));
+    index_load();
+    if (shard_start() < 0) return -1;
+    index_restore_generation();
+    // 对照磁盘校正索引(变化的文件重新计算hash), 得到逻辑路径和元数据
+    index_scan_dir("");
+
+    std::vector<std::string> files;
+    pthread_rwlock_rdlock(&index_lock);
+    for (auto &item: index_entries) {
+        if (!item.second.deleted && item.first.back() != '/') files.push_back(item.first);
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    std::unordered_map<uint64_t, std::string> owners;
+    size_t copied = 0, failed = 0;
+    for (auto &path: files) {
+        std::string src = QUERY_PATH + path;
+        uint64_t key = shard_key(path);
+        auto owner = owners.emplace(key, path);
+        std::string physical = shard_physical_path(key);
+        std::string tmp_path = shard_tmp_path(path);
+        shard_make_dirs(physical);
+        unlink(tmp_path.c_str());
+        bool ok = owner.second;
+        if (!ok) {
+            output_error("shard key collision: " + path + " and " + owner.first->second);
+        } else if (shard_copy_file(src, tmp_path) == 0) {
+            copied++;
+        } else {
+            output_error("fail to copy file: " + src);
+            ok = false;
+        }
+        if (ok && rename(tmp_path.c_str(), physical.c_str()) < 0) {
+            output_error("fail to save file: " + physical);
+            ok = false;
+        }
+        if (!ok) {
+            // 没有迁移的文件不能留在元数据中
+            unlink(tmp_path.c_str());
+            pthread_rwlock_wrlock(&index_lock);
+            index_remove_locked(path);
+            pthread_rwlock_unlock(&index_lock);
+            failed++;
+        }
+    }
+    int res = index_flush();
+    output_info("migrated " + std::to_string(files.size() - failed) + " files (" + std::to_string(copied) +
+                " copied, " + std::to_string(failed) + " failed)");
+    return res < 0 || failed > 0 ? -1 : 0;
+}
+
+// 启动索引: 映射已有的索引文件(不存在时由索引线程全量建立)
+void index_start() {
+    if (index_load() == 0) {
+        output_info("loaded index: " + std::string(INDEX_PATH) + " (" + std::to_string(index_entries.size()) +
+                    " entries, generation=" + std::to_string(index_generation) + ")");
+    } else {
+        output_warn("no valid index, building: " + std::string(INDEX_PATH));
+    }
+    if (sharded_storage) {
+        if (shard_start() < 0) return;
+    } else if ((index_inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        output_error("fail to init inotify");
+        return;
+    }
+    index_restore_generation();
+    pthread_t pthread_id;
+    if (pthread_create(&pthread_id, nullptr, thread_index, nullptr) != 0) {
+        output_error("fail to create thread");
+        return;
+    }
+    pthread_detach(pthread_id);
+}
+
+// 把一个搜索结果打包进批次的最后一条信息(同tree_pack), 批次已满时返回false(先发送再重试)
+bool search_pack(std::vector<MSG> &batch, const std::string &path, const INDEX_ENTRY &entry) {
+    size_t length = (sizeof(SEARCH_PACKED_ENTRY) + path.length() + 7) & ~(size_t) 7;
+    if (batch.empty() || batch.back().bytes + length > sizeof(batch.back().fname)) {
+        if (batch.size() >= SEARCH_BATCH) return false;
+        batch.emplace_back();
+        MSG &info_msg = batch.back();
+        info_msg.clear();
+        info_msg.type = MSG_TYPE_SEARCH;
+        info_msg.flag = SEARCH_FLAG_PACKED;
+    }
+    MSG &info_msg = batch.back();
+    SEARCH_PACKED_ENTRY packed = {entry, (int32_t) path.length(), 0};
+    memcpy(info_msg.fname + info_msg.bytes, &packed, sizeof(packed));
+    memcpy(info_msg.fname + info_msg.bytes + sizeof(packed), path.data(), path.length());
+    info_msg.bytes += (int) length;
+    return true;
+}
+
+// 搜索函数(在内存索引中查找, 分批发送结果)
+void func_search(int accept_socket, MSG &receive_msg) {
+    std::string pattern = receive_msg.fname;
+    uint64_t since = 0;
+    if (receive_msg.flag == SEARCH_CHANGED) {
+        memcpy(&since, receive_msg.buffer, sizeof(since));
+    }
+    output_info("searching index: mode=" + std::to_string(receive_msg.flag) + ", pattern=" + pattern);
+
+    // 持锁时只复制结果, 发送时不持锁
+    std::vector<std::pair<std::string, INDEX_ENTRY>> results;
+    uint64_t generation;
+    pthread_rwlock_rdlock(&index_lock);
+    generation = index_generation;
+    // 起点之后的墓碑可能已被清除, 变化列表不完整, 只能让客户端完全重新同步(从0开始的查询不需要墓碑)
+    if (receive_msg.flag == SEARCH_CHANGED && since > 0 && since < index_horizon) {
+        uint64_t horizon = index_horizon;
+        pthread_rwlock_unlock(&index_lock);
+        output_warn("changes since " + std::to_string(since) + " were compacted (horizon=" +
+                    std::to_string(horizon) + "), full resync required");
+        MSG resync_msg = {0};
+        resync_msg.clear();
+        resync_msg.type = MSG_TYPE_SEARCH;
+        resync_msg.flag = SEARCH_FLAG_RESYNC;
+        memcpy(resync_msg.buffer, &generation, sizeof(generation));
+        resync_msg.bytes = sizeof(generation);
+        write_net_with_log(accept_socket, &resync_msg, sizeof(resync_msg), "send search resync");
+        return;
+    }
+    switch (receive_msg.flag) {
+        case SEARCH_PREFIX:
+            for (auto it = index_entries.lower_bound(pattern);
+                 it != index_entries.end() && it->first.compare(0, pattern.length(), pattern) == 0; ++it) {
+                if (!it->second.deleted) results.emplace_back(*it);
+            }
+            break;
+        case SEARCH_GLOB:
+            for (auto &item: index_entries) {
+                if (!item.second.deleted && fnmatch(pattern.c_str(), item.first.c_str(), 0) == 0) {
+                    results.emplace_back(item);
+                }
+            }
+            break;
+        case SEARCH_SUBSTRING:
+            for (auto &item: index_entries) {
+                if (!item.second.deleted && item.first.find(pattern) != std::string::npos) {
+                    results.emplace_back(item);
+                }
+            }
+            break;
+        case SEARCH_CHANGED:
+            for (auto &item: index_entries) {
+                if (item.second.generation > since) results.emplace_back(item);
+            }
+            break;
+        default:
+            pthread_rwlock_unlock(&index_lock);
+            write_net_error_with_log(accept_socket, "unknown search mode:" + std::to_string(receive_msg.flag),
+                                     "send error to client");
+            return;
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    // 打包后分批发送(每条信息放多个条目)
+    std::vector<MSG> batch;
+    batch.reserve(SEARCH_BATCH);
+    for (size_t i = 0; i <= results.size(); ++i) {
+        if (i < results.size() && sizeof(SEARCH_PACKED_ENTRY) + results[i].first.length() > sizeof(MSG::fname)) {
+            output_warn("path too long, skipped: " + results[i].first);
+            continue;
+        }
+        if (i == results.size() || !search_pack(batch, results[i].first, results[i].second)) {
+            if (!batch.empty() &&
+                write_net_batch_with_log(accept_socket, batch.data(), batch.size(), "send search results") < 0) {
+                output_error("send search results error");
+                return;
+            }
+            batch.clear();
+            if (i < results.size()) search_pack(batch, results[i].first, results[i].second);
+        }
+    }
+
+    // 发送结束标志(buffer中是当前版本号, 供下次"变化查询"使用)
+    MSG end_msg = {0};
+    end_msg.clear();
+    end_msg.type = MSG_TYPE_SEARCH;
+    end_msg.flag = SEARCH_FLAG_END;
+    memcpy(end_msg.buffer, &generation, sizeof(generation));
+    end_msg.bytes = sizeof(generation);
+    write_net_with_log(accept_socket, &end_msg, sizeof(end_msg), "send search end");
+    output_info("searched index: " + std::to_string(results.size()) + " results");
+}
+
+// 请求跟踪环形缓冲区的一个槽(sequence表示槽的状态, 见trace_push/trace_pop)
+struct trace_slot {
+    std::atomic<uint64_t> sequence;
+    TRACE_RECORD record;
+};
+
+// 请求跟踪: 处理请求的线程无锁写入环形缓冲区, 写线程批量写入文件(trace_fp为空表示未开启)
+FILE *trace_fp = nullptr;
+int64_t trace_start_time = 0;                    // 开始跟踪的时间(CLOCK_MONOTONIC, 微秒)
+trace_slot trace_ring[TRACE_RING_SIZE];
+std::atomic<uint64_t> trace_head{0};             // 下一个写入位置(多个生产者)
+uint64_t trace_tail = 0;                         // 下一个读取位置(只有写线程使用)
+std::atomic<uint64_t> trace_dropped{0};          // 缓冲区满时丢弃的记录数
+std::atomic<uint32_t> trace_connections{0};      // 连接编号
+
+// 当前时间(微秒)
+int64_t trace_now(clockid_t clock = CLOCK_MONOTONIC) {
+    struct timespec ts{};
+    clock_gettime(clock, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 写入一条记录(有界MPSC队列, 槽的sequence等于写入位置时可写, 等于位置+1时可读), 缓冲区满时丢弃
+void trace_push(const TRACE_RECORD &record) {
+    uint64_t pos = trace_head.load(std::memory_order_relaxed);
+    while (true) {
+        trace_slot &slot = trace_ring[pos & (TRACE_RING_SIZE - 1)];
+        auto diff = (int64_t) (slot.sequence.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (trace_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.record = record;
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return;
+            }
+        } else if (diff < 0) {
+            trace_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = trace_head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// 取出一条记录(只有写线程调用)
+bool trace_pop(TRACE_RECORD &record) {
+    trace_slot &slot = trace_ring[trace_tail & (TRACE_RING_SIZE - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != trace_tail + 1) return false;
+    record = slot.record;
+    slot.sequence.store(trace_tail + TRACE_RING_SIZE, std::memory_order_release);
+    trace_tail++;
+    return true;
+}
+
+// 被请求文件的大小, 不存在返回-1
+int64_t trace_file_size(const char *path) {
+    if (sharded_storage) {
+        INDEX_ENTRY entry;
+        return shard_resolve(path, &entry).empty() ? -1 : entry.size;
+    }
+    struct stat fileInfo{};
+    return stat((DOWNLOAD_PATH + std::string(path)).c_str(), &fileInfo) == 0 ? fileInfo.st_size : -1;
+}
+
+// 记录一个处理完的请求
+void trace_request(uint32_t conn, const MSG &receive_msg, int64_t start) {
+    TRACE_RECORD record;
+    memset(&record, 0, sizeof(record));
+    record.time = start - trace_start_time;
+    record.duration = trace_now() - start;
+    record.conn = conn;
+    record.type = receive_msg.type;
+    record.flag = receive_msg.flag;
+    record.bytes = receive_msg.bytes;
+    memcpy(record.fname, receive_msg.fname, strnlen(receive_msg.fname, sizeof(record.fname) - 1));
+    switch (receive_msg.type) {
+        case MSG_TYPE_DOWNLOAD:
+        case MSG_TYPE_HASH:
+            record.size = trace_file_size(receive_msg.fname);
+            break;
+        case MSG_TYPE_UPLOAD:
+            record.size = receive_msg.bytes;
+            break;
+        case MSG_TYPE_UPLOAD_BULK:
+            UPLOAD_HEADER header;
+            memcpy(&header, receive_msg.buffer, sizeof(header));
+            record.size = header.length;
+            break;
+        default:
+            memcpy(record.arg, receive_msg.buffer, sizeof(record.arg));
+    }
+    // 同一路径的文件总是生成同样的内容
+    record.seed = hash_update(HASH_INIT, record.fname, strlen(record.fname));
+    trace_push(record);
+}
+
+// 请求跟踪写线程
+void *thread_trace(void *arg) {
+    TRACE_RECORD record;
+    uint64_t reported = 0;
+    while (true) {
+        size_t count = 0;
+        while (trace_pop(record)) {
+            if (fwrite(&record, sizeof(record), 1, trace_fp) != 1) output_error("fail to write trace");
+            count++;
+        }
+        if (count > 0) fflush(trace_fp);
+        uint64_t dropped = trace_dropped.load(std::memory_order_relaxed);
+        if (dropped != reported) {
+            output_warn("trace buffer full, dropped " + std::to_string(dropped) + " records");
+            reported = dropped;
+        }
+        if (count == 0) usleep(TRACE_DRAIN_INTERVAL * 1000);
+    }
+    return nullptr;
+}
+
+// 开启请求跟踪(在接收连接之前调用)
+int trace_start(const char *path) {
+    trace_fp = fopen(path, "wb");
+    if (nullptr == trace_fp) {
+        output_error("fail to open trace: " + std::string(path));
+        return -1;
+    }
+    for (uint64_t i = 0; i < TRACE_RING_SIZE; ++i) trace_ring[i].sequence.store(i, std::memory_order_relaxed);
+    trace_start_time = trace_now();
+    TRACE_HEADER header = {{0}, sizeof(TRACE_RECORD), 0, trace_now(CLOCK_REALTIME)};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    if (fwrite(&header, sizeof(header), 1, trace_fp) != 1 || fflush(trace_fp) != 0) {
+        output_error("fail to write trace: " + std::string(path));
+        fclose(trace_fp);
+        trace_fp = nullptr;
+        return -1;
+    }
+    pthread_t pthread_id;
+    if (pthread_create(&pthread_id, nullptr, thread_trace, nullptr) != 0) {
+        output_error("fail to create thread");
+        fclose(trace_fp);
+        trace_fp = nullptr;
+        return -1;
+    }
+    pthread_detach(pthread_id);
+    output_info("tracing requests: " + std::string(path));
+    return 0;
+}
+
+// 连接所处的阶段(超时检查按阶段区分)
+enum conn_phase {
+    CONN_IDLE,   // 等待下一个请求(包括请求头只收到一部分)
+    CONN_QUEUED, // 等待上传/下载的名额(服务端的原因, 不检查超时)
+    CONN_ACTIVE, // 正在处理请求
+};
+
+// 连接状态: 连接线程更新阶段, 时间轮线程检查超时
+struct conn_state {
+    int socket;
+    std::atomic<int> phase{CONN_IDLE};
+    std::atomic<int64_t> since{0}; // 进入当前阶段的时间(秒)
+    std::atomic<bool> receiving{false}; // 正在接收上传的内容(等待客户端发送)
+    int slot = -1;                 // 所在的时间轮槽, 以下字段都需持有timer_lock
+    int64_t measured_since = -1;   // 正在测量吞吐量的阶段(since), -1表示未开始
+    uint64_t measured_bytes = 0;   // 上次检查时已收发的字节数
+    int64_t measured_time = 0;     // 上次检查的时间(秒)
+    bool evicted = false;
+};
+
+// 准入控制的排队通道: 不排队(便宜的元数据查询), 上传/下载, 遍历整棵树或整个索引的查询
+enum admission_lane {
+    LANE_NONE, LANE_TRANSFER, LANE_QUERY, LANE_COUNT
+};
+
+// 准入控制: 连接数上限和各通道的名额(便宜的元数据查询优先, 不占名额)
+std::atomic<int> admission_connections{0};
+pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t admission_cond[LANE_COUNT] = {PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                                             PTHREAD_COND_INITIALIZER};
+int admission_running[LANE_COUNT] = {0};  // 各通道正在处理的请求数, 需持有admission_lock
+const int admission_limit[LANE_COUNT] = {0, MAX_BULK_TRANSFERS, MAX_BULK_QUERIES};
+
+// 超时检查的时间轮: 每个连接挂在下一次检查时间对应的槽上, 每秒只处理到期的槽
+std::vector<conn_state *> timer_wheel[TIMER_WHEEL_SLOTS];
+pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+int64_t timer_tick = 0; // 已处理到的时间(秒), 需持有timer_lock
+
+static_assert(IDLE_TIMEOUT < TIMER_WHEEL_SLOTS && THROUGHPUT_WINDOW < TIMER_WHEEL_SLOTS,
+              "timeouts must fit in one turn of the timer wheel");
+
+// 当前时间(秒)
+int64_t timer_now() {
+    struct timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// 把连接挂到delay秒后的槽上, 需持有timer_lock(delay在1到TIMER_WHEEL_SLOTS-1之间, 不会挂回当前槽)
+void timer_schedule_locked(conn_state *state, int64_t delay) {
+    state->slot = (int) ((timer_tick + delay) % TIMER_WHEEL_SLOTS);
+    timer_wheel[state->slot].push_back(state);
+}
+
+// 从时间轮中移除, 需持有timer_lock
+void timer_remove_locked(conn_state *state) {
+    auto &slot = timer_wheel[state->slot];
+    auto it = std::find(slot.begin(), slot.end(), state);
+    if (it != slot.end()) {
+        *it = slot.back();
+        slot.pop_back();
+    }
+    state->slot = -1;
+}
+
+// 连接已收发的字节数(内核统计, 包括递归查询工作线程和零拷贝收发的数据)
+uint64_t conn_transferred(int socket) {
+    struct tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) return 0;
+    return info.tcpi_bytes_acked + info.tcpi_bytes_received;
+}
+
+thread_local conn_state *conn_current = nullptr; // 当前连接线程的连接状态
+
+// 切换连接的阶段
+void conn_set_phase(conn_state *state, conn_phase phase) {
+    state->since.store(timer_now(), std::memory_order_relaxed);
+    state->phase.store(phase, std::memory_order_release);
+}
+
+// 注册/注销连接(注销后连接线程才能关闭socket, 避免时间轮对复用的fd执行shutdown)
+void conn_register(conn_state *state) {
+    conn_current = state;
+    conn_set_phase(state, CONN_IDLE);
+    pthread_mutex_lock(&timer_lock);
+    timer_schedule_locked(state, std::min(IDLE_TIMEOUT, THROUGHPUT_WINDOW));
+    pthread_mutex_unlock(&timer_lock);
+}
+
+void conn_unregister(conn_state *state) {
+    pthread_mutex_lock(&timer_lock);
+    timer_remove_locked(state);
+    pthread_mutex_unlock(&timer_lock);
+    conn_current = nullptr;
+}
+
+// 标记当前连接线程是否在接收上传的内容
+void conn_set_receiving(bool receiving) {
+    if (conn_current != nullptr) conn_current->receiving.store(receiving, std::memory_order_relaxed);
+}
+
+// 服务端是否在等客户端: 发出的数据没有被确认(客户端不读), 或者在接收上传但接收队列是空的(客户端不发)
+// 服务端自己的处理(计算hash、提交分片、等锁)期间两者都不成立
+bool conn_blocked(conn_state *state) {
+    int queued = 0;
+    if (ioctl(state->socket, SIOCOUTQ, &queued) == 0 && queued > 0) return true;
+    return state->receiving.load(std::memory_order_relaxed) && ioctl(state->socket, SIOCINQ, &queued) == 0 &&
+           queued == 0;
+}
+
+// 驱逐连接: shutdown唤醒阻塞在read/write上的连接线程, 由它自己关闭socket
+void conn_evict(conn_state *state, const std::string &reason) {
+    output_warn("evict connection (accept_socket=" + std::to_string(state->socket) + "): " + reason);
+    state->evicted = true;
+    shutdown(state->socket, SHUT_RDWR);
+}
+
+// 检查一个连接, 返回下次检查的间隔(秒), 需持有timer_lock
+int64_t conn_check_locked(conn_state *state, int64_t now) {
+    int phase = state->phase.load(std::memory_order_acquire);
+    int64_t since = state->since.load(std::memory_order_relaxed);
+    if (state->evicted) return THROUGHPUT_WINDOW;
+    if (phase == CONN_IDLE) {
+        state->measured_since = -1;
+        // 按整个请求的等待时间计算, 慢慢发送请求头的连接也会超时
+        if (now - since >= IDLE_TIMEOUT) {
+            conn_evict(state, "idle for " + std::to_string(now - since) + "s");
+            return THROUGHPUT_WINDOW;
+        }
+        return std::min<int64_t>(since + IDLE_TIMEOUT - now, THROUGHPUT_WINDOW);
+    }
+    if (phase == CONN_QUEUED) {
+        state->measured_since = -1;
+        return THROUGHPUT_WINDOW;
+    }
+    // 处理请求中: 只在服务端等客户端时测量, 窗口两端都在等且收发的数据太少, 说明客户端不读或不发
+    if (!conn_blocked(state)) {
+        state->measured_since = -1;
+        return THROUGHPUT_WINDOW;
+    }
+    uint64_t bytes = conn_transferred(state->socket);
+    if (state->measured_since == since) {
+        int64_t elapsed = now - state->measured_time;
+        if (elapsed > 0 && bytes - state->measured_bytes < (uint64_t) (MIN_THROUGHPUT * elapsed)) {
+            conn_evict(state, "too slow (" + std::to_string((bytes - state->measured_bytes) / elapsed) + " bytes/s)");
+            return THROUGHPUT_WINDOW;
+        }
+    }
+    state->measured_since = since;
+    state->measured_bytes = bytes;
+    state->measured_time = now;
+    return THROUGHPUT_WINDOW;
+}
+
+// 超时检查线程: 每秒推进时间轮, 检查到期槽上的连接并重新挂到下次检查的槽上
+void *thread_timer(void *arg) {
+    while (true) {
+        sleep(1);
+        int64_t now = timer_now();
+        pthread_mutex_lock(&timer_lock);
+        while (timer_tick < now) {
+            ++timer_tick;
+            std::vector<conn_state *> due;
+            due.swap(timer_wheel[timer_tick % TIMER_WHEEL_SLOTS]);
+            for (conn_state *state: due) timer_schedule_locked(state, conn_check_locked(state, timer_tick));
+        }
+        pthread_mutex_unlock(&timer_lock);
+    }
+    return nullptr;
+}
+
+// 开启超时检查
+void timer_start() {
+    timer_tick = timer_now();
+    pthread_t pthread_id;
+    if (pthread_create(&pthread_id, nullptr, thread_timer, nullptr) != 0) {
+        output_error("fail to create thread");
+        return;
+    }
+    pthread_detach(pthread_id);
+}
+
+// accept队列中等待的连接数(对监听socket, tcpi_unacked是当前的accept队列长度)
+int admission_backlog(int server_socket) {
+    struct tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(server_socket, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) return 0;
+    return (int) info.tcpi_unacked;
+}
+
+// 回复繁忙并关闭连接(不创建线程, 尽快处理完accept队列)
+void admission_reject(int accept_socket, int retry_after) {
+    MSG busy_msg = {0};
+    busy_msg.clear();
+    busy_msg.type = MSG_TYPE_BUSY;
+    busy_msg.flag = retry_after;
+    // 新连接的发送缓冲区是空的, 不会阻塞; 发不出去就直接关闭
+    send(accept_socket, &busy_msg, sizeof(busy_msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(accept_socket, SHUT_WR);
+    // 丢弃已经到达的请求, 否则close会发送RST, 客户端可能收不到繁忙回复
+    char buffer[BUFFER_SIZE];
+    while (recv(accept_socket, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+    close(accept_socket);
+}
+
+// 请求的排队通道: 上传/下载等大量传输, 以及遍历整棵树或整个索引的查询(饱和时排队, 让便宜的元数据查询先得到处理)
+admission_lane admission_classify(const MSG &msg) {
+    switch (msg.type) {
+        case MSG_TYPE_DOWNLOAD:
+        case MSG_TYPE_UPLOAD_BULK:
+            return LANE_TRANSFER;
+        case MSG_TYPE_HASH: // 分片存储的hash直接从索引中取
+            return sharded_storage ? LANE_NONE : LANE_TRANSFER;
+        case MSG_TYPE_QUERY_TREE: // 只列一层只读一个目录
+            return msg.flag == 1 ? LANE_NONE : LANE_QUERY;
+        case MSG_TYPE_SEARCH: { // 非空前缀只扫描索引的一段, 其他方式(以及从0开始的变化查询)扫描或返回整个索引
+            uint64_t since = 0;
+            if (msg.flag == SEARCH_CHANGED) memcpy(&since, msg.buffer, sizeof(since));
+            bool cheap = (msg.flag == SEARCH_PREFIX && msg.fname[0] != '\0') || (msg.flag == SEARCH_CHANGED && since > 0);
+            return cheap ? LANE_NONE : LANE_QUERY;
+        }
+        default:
+            return LANE_NONE;
+    }
+}
+
+// 进入请求处理: 排队通道中的请求等待名额, 其他请求直接处理; 返回占用的通道
+admission_lane admission_acquire(conn_state *state, const MSG &msg) {
+    admission_lane lane = admission_classify(msg);
+    if (lane == LANE_NONE) {
+        conn_set_phase(state, CONN_ACTIVE);
+        return lane;
+    }
+    conn_set_phase(state, CONN_QUEUED);
+    pthread_mutex_lock(&admission_lock);
+    while (admission_running[lane] >= admission_limit[lane]) pthread_cond_wait(&admission_cond[lane], &admission_lock);
+    admission_running[lane]++;
+    pthread_mutex_unlock(&admission_lock);
+    conn_set_phase(state, CONN_ACTIVE);
+    return lane;
+}
+
+// 请求处理完成, 释放名额
+void admission_release(admission_lane lane) {
+    if (lane == LANE_NONE) return;
+    pthread_mutex_lock(&admission_lock);
+    admission_running[lane]--;
+    pthread_cond_signal(&admission_cond[lane]);
+    pthread_mutex_unlock(&admission_lock);
+}
+
 // 用于给每个客户端提供服务(监听)
 void *thread_listen(void *arg) {
 
-    static int fd = -1;
-    char up_file_path[NAME_MAX] = {0};
-    int accept_socket = *(int *) arg;
+    int fd = -1;               // 旧上传协议正在写入的文件(跨多条信息)
+    std::string up_file_path;  // 以及它的路径(分片存储时是临时文件)
+    int accept_socket = (int) (intptr_t) arg;
     ssize_t res;
+    uint32_t conn = ++trace_connections;
+    conn_state state;
+    state.socket = accept_socket;
+    conn_register(&state);
 
     MSG receive_msg = {0};
 
     // 持续接收
     for (receive_msg.clear(); true; receive_msg.clear()) {
         // 接收
+        conn_set_phase(&state, CONN_IDLE);
         res = read_net_with_log(accept_socket, &receive_msg, sizeof(MSG), "received, switching");
 
-        if (res == 0) {
+        if (res < (ssize_t) sizeof(MSG)) {
             output_info("connection close or lost");
             break;
         }
+        int64_t start = trace_fp != nullptr ? trace_now() : 0;
+        admission_lane lane = admission_acquire(&state, receive_msg);
         // 判断类型
         switch (receive_msg.type) {
             case MSG_TYPE_QUERY: // 查询
@@ -342,38 +2426,100 @@ void *thread_listen(void *arg) {
                 func_download(accept_socket, receive_msg.fname);
                 break;
             case MSG_TYPE_UPLOAD: // 上传
-                func_upload(fd, receive_msg);
+                func_upload(fd, up_file_path, receive_msg);
+                break;
+            case MSG_TYPE_QUERY_TREE: // 递归查询
+                func_query_tree(accept_socket, receive_msg);
+                break;
+            case MSG_TYPE_HASH: // 查询hash
+                func_hash(accept_socket, receive_msg.fname);
+                break;
+            case MSG_TYPE_SEARCH: // 搜索
+                func_search(accept_socket, receive_msg);
+                break;
+            case MSG_TYPE_UPLOAD_BULK: // 批量上传
+                func_upload_bulk(accept_socket, receive_msg);
                 break;
             default:
                 output_error(std::string("unknown type") + std::to_string(receive_msg.type));
         }
+        admission_release(lane);
+        if (trace_fp != nullptr) trace_request(conn, receive_msg, start);
     }
 
+    // 旧上传协议传到一半断开
+    if (fd != -1) {
+        close(fd);
+        if (sharded_storage) unlink(up_file_path.c_str());
+    }
+    conn_unregister(&state);
+    close(accept_socket);
+    admission_connections--;
     return nullptr;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     printf("[Hello] I'm server!\n");
 
+    // 迁移到分片存储(离线执行)
+    if (argc > 1 && strcmp(argv[1], "--migrate") == 0) {
+        return shard_migrate() < 0 ? 1 : 0;
+    }
+    // 记录请求, 供客户端回放("./client replay <trace> <host>")
+    if (argc > 1 && strcmp(argv[1], "--trace") == 0 && trace_start(argc > 2 ? argv[2] : TRACE_PATH) < 0) {
+        return 1;
+    }
+
     // 初始化
     int server_socket = init_server_socket();
     int accept_socket;
+    // 客户端断开或被驱逐后写socket返回EPIPE, 不能让SIGPIPE结束进程
+    signal(SIGPIPE, SIG_IGN);
 
-    // 多线程
+    // 文件索引
+    index_start();
+    // 空闲/慢客户端超时检查
+    timer_start();
+    // 递归查询线程池
+    tree_pool_start();
+
+    // 多线程(线程分离, 退出时自己关闭socket; 栈不需要默认的8MB)
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, CONNECTION_STACK_SIZE);
     output_info("start waiting client's connection");
     unsigned long count = 0;
     for (pthread_t pthread_id; true;) {
         // 接收客户端连接
-        accept_socket = accept(server_socket, nullptr, nullptr);
-        // 新建线程来处理连接
-        pthread_create(&pthread_id, nullptr, thread_listen, &accept_socket);
+        accept_socket = accept4(server_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (accept_socket < 0) {
+            output_error("fail to accept");
+            // fd用完时稍等, 避免空转
+            if (errno == EMFILE || errno == ENFILE) usleep(100 * 1000);
+            continue;
+        }
+        // 过载时快速回复繁忙: 连接数到上限, 或accept队列积压(来不及处理)
+        int active = admission_connections.load();
+        int backlog = admission_backlog(server_socket);
+        if (active >= MAX_CONNECTIONS || backlog > ACCEPT_QUEUE_SHED) {
+            int retry_after = BUSY_RETRY_AFTER * (1 + backlog / ACCEPT_QUEUE_SHED + active / MAX_CONNECTIONS);
+            output_warn("server busy (connections=" + std::to_string(active) + ", backlog=" +
+                        std::to_string(backlog) + "), retry after " + std::to_string(retry_after) + "ms");
+            admission_reject(accept_socket, retry_after);
+            continue;
+        }
+        // 新建线程来处理连接(socket按值传递, 下一次accept不会覆盖)
+        admission_connections++;
+        if (pthread_create(&pthread_id, &attr, thread_listen, (void *) (intptr_t) accept_socket) != 0) {
+            output_error("fail to create thread");
+            admission_connections--;
+            admission_reject(accept_socket, BUSY_RETRY_AFTER);
+            continue;
+        }
         output_info(std::string("finish connecting NO.") + std::to_string(++count) +
                     " client (pthread_id=" + std::to_string(pthread_id) +
                     ", accept_socket=" + std::to_string(accept_socket) + ")");
-        if (pthread_id < 0) {
-            output_error("fail to create thread");
-            break;
-        }
     }
 
     printf("[Goodbye]\n");